@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+/* The memory of an instance, apart from its delay lines, in one page
+ * aligned, zeroed allocation. Parts are reserved up front, which gives
+ * their offsets into the arena, and looked up with arena_at() once the
+ * arena has been allocated. Every part starts on a cache line of its own.
+ *
+ * Zeroing touches every page, so run() doesn't take page faults on the
+ * instance's state. With LLP_MLOCK set to anything but 0 in the
+ * environment, the pages are also locked into memory. Delay lines are
+ * mapped separately, see delay_line.h, and locked as well. */
+struct arena {
+  char            *base;
+  size_t           size;
+  int              locked;
+};
+
+size_t arena_reserve(struct arena *arena, size_t size);
+int arena_allocate(struct arena *arena);
+void arena_free(struct arena *arena);
+
+/* Whether LLP_MLOCK asks for memory to be locked */
+int mlock_requested(void);
+
+static inline void *arena_at(const struct arena *arena, size_t offset)
+{
+  return arena->base + offset;
+}
+
+#endif
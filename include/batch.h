@@ -0,0 +1,56 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "ladspa.h"
+
+/* Extension to LADSPA for running many channels of one plugin with the
+ * same controls, e.g. every track of a bus or every speaker of an array,
+ * without an instance and a run() call per channel.
+ *
+ * A batch is instantiated with a number of channels and keeps the state
+ * of all of them together, channel-major: where a plugin has per-channel
+ * state such as a delay line, each frame holds the sample of every
+ * channel, so the kernels vectorize across channels and stay efficient at
+ * block sizes too small to vectorize across samples. State that only
+ * depends on the controls is computed once for the whole batch.
+ *
+ * Each channel renders what an instance of the plugin would, given the
+ * same controls and input, except that a batch only bypasses its work
+ * while every channel is silent. The batch has the ports of its plugin.
+ * Control ports are connected once for the whole batch, audio ports once
+ * per channel. The same rules for in-place processing and real-time use
+ * as for the plugin apply. */
+typedef struct _LLP_Batch_Descriptor {
+
+  /* Plugin the batch runs channels of */
+  const LADSPA_Descriptor *Descriptor;
+
+  LADSPA_Handle (*instantiate)(const struct _LLP_Batch_Descriptor *Descriptor,
+                               unsigned long SampleRate,
+                               unsigned long ChannelCount);
+
+  /* Channel is ignored for control ports */
+  void (*connect_port)(LADSPA_Handle Batch,
+                       unsigned long Port,
+                       unsigned long Channel,
+                       LADSPA_Data *DataLocation);
+
+  /* May be NULL, like their counterparts in the plugin descriptor */
+  void (*activate)(LADSPA_Handle Batch);
+  void (*deactivate)(LADSPA_Handle Batch);
+
+  void (*run)(LADSPA_Handle Batch, unsigned long SampleCount);
+
+  void (*cleanup)(LADSPA_Handle Batch);
+
+} LLP_Batch_Descriptor;
+
+/* Exported next to ladspa_descriptor(). Returns the batch version of the
+ * plugin ladspa_descriptor() returns for the same index, or NULL if that
+ * plugin has no batch version or the index is out of range. */
+const LLP_Batch_Descriptor *llp_batch_descriptor(unsigned long Index);
+
+typedef const LLP_Batch_Descriptor *
+(*LLP_Batch_Descriptor_Function)(unsigned long Index);
+
+#endif
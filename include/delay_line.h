@@ -0,0 +1,223 @@
+#ifndef DELAY_LINE_H
+#define DELAY_LINE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "ladspa.h"
+
+/* A left and a right sample side by side, processed as the two lanes of
+ * one vector */
+typedef LADSPA_Data stereo_frame __attribute__((vector_size(2 * sizeof(LADSPA_Data))));
+typedef int stereo_mask __attribute__((vector_size(2 * sizeof(int))));
+
+/* Ring buffer of frames with a power-of-two capacity, so positions wrap
+ * with a mask instead of a compare and subtract. Positions are free
+ * running frame counts; the write cursor is the position of the next
+ * frame to be written, and a tap d frames back is at cursor - d.
+ *
+ * The ring is mapped and faulted in when it is reserved, with pages that
+ * are zero already, and locked too with LLP_MLOCK set, see arena.h. Frames
+ * from before the first one written since the line was cleared read as
+ * silence: they hold zeros, and taps skip them without reading them, see
+ * delay_line_unwritten(). Clearing the line only zeroes what was written.
+ *
+ * The line also counts how many of the most recently written frames are
+ * silent, see SILENCE_THRESHOLD. Once that covers the whole ring the line
+ * holds nothing audible, and a plugin whose input is silent too can skip
+ * its work and only move the cursor along. */
+struct delay_line {
+  union {
+    LADSPA_Data   *data;
+    stereo_frame  *frames;
+  };
+  unsigned long    mask;
+  unsigned long    cursor;
+
+  /* Number of frames written since the line was cleared, up to its size.
+   * Unlike the cursor, it never wraps around. */
+  unsigned long    written;
+
+  /* Number of frames just behind the cursor that are known to be silent */
+  unsigned long    silent;
+
+  /* Size of a frame, in bytes */
+  size_t           frame_size;
+};
+
+/* A run of positions, split where it wraps around the end of the ring */
+struct delay_span {
+  LADSPA_Data     *first;
+  unsigned long    first_count;
+  LADSPA_Data     *second;
+  unsigned long    second_count;
+};
+
+/* Smallest capacity that holds at least length frames */
+unsigned long delay_line_capacity(unsigned long length);
+
+/* Reserves memory for a line of at least length frames of frame_size
+ * bytes, and faults it in. Fails if the memory can't be had. Not real-time
+ * safe; call from instantiate(). */
+int delay_line_reserve(struct delay_line *line, unsigned long length, size_t frame_size);
+
+/* Releases the memory of a line. Not real-time safe; call from
+ * cleanup(). */
+void delay_line_release(struct delay_line *line);
+
+/* Zeroes the frames written since the line was last cleared and moves the
+ * cursor back to the start. The pages stay faulted in. Call from
+ * activate() or deactivate(). */
+void delay_line_clear(struct delay_line *line);
+
+static inline unsigned long delay_line_size(const struct delay_line *line)
+{
+  return line->mask + 1;
+}
+
+static inline unsigned long delay_line_index(const struct delay_line *line, unsigned long position)
+{
+  return position & line->mask;
+}
+
+/* Frames that have been written since the line was cleared, which is also
+ * how much of the ring is dirty */
+static inline unsigned long delay_line_written(const struct delay_line *line)
+{
+  return line->written;
+}
+
+/* Number of the count positions from delay frames behind the cursor on
+ * that come before the first frame written since the line was cleared, and
+ * so read as silence */
+static inline unsigned long delay_line_unwritten(const struct delay_line *line,
+                                                 unsigned long delay,
+                                                 unsigned long count)
+{
+  const unsigned long unwritten = delay > line->written ? delay - line->written : 0;
+  return unwritten < count ? unwritten : count;
+}
+
+static inline LADSPA_Data *delay_line_at(const struct delay_line *line, unsigned long position)
+{
+  return &line->data[delay_line_index(line, position)];
+}
+
+/* Frame at a position, for lines whose frames hold any number of samples */
+static inline LADSPA_Data *delay_line_frame(const struct delay_line *line, unsigned long position)
+{
+  return (LADSPA_Data *) ((char *) line->data + delay_line_index(line, position) * line->frame_size);
+}
+
+/* Number of positions from position up to the end of the ring */
+static inline unsigned long delay_line_contiguous(const struct delay_line *line, unsigned long position)
+{
+  return delay_line_size(line) - delay_line_index(line, position);
+}
+
+static inline struct delay_span delay_line_span(const struct delay_line *line,
+                                                unsigned long position,
+                                                unsigned long count)
+{
+  const unsigned long contiguous = delay_line_contiguous(line, position);
+  const unsigned long first_count = count < contiguous ? count : contiguous;
+
+  return (struct delay_span) {
+    .first        = delay_line_at(line, position),
+    .first_count  = first_count,
+    .second       = line->data,
+    .second_count = count - first_count,
+  };
+}
+
+static inline LADSPA_Data delay_line_tap(const struct delay_line *line, unsigned long delay)
+{
+  return *delay_line_at(line, line->cursor - delay);
+}
+
+/* Linearly interpolated tap for delays that fall between samples */
+static inline LADSPA_Data delay_line_tap_fractional(const struct delay_line *line, LADSPA_Data delay)
+{
+  const unsigned long whole = (unsigned long) delay;
+  const LADSPA_Data fraction = delay - (LADSPA_Data) whole;
+  const LADSPA_Data newer = delay_line_tap(line, whole);
+  const LADSPA_Data older = delay_line_tap(line, whole + 1);
+
+  return newer + fraction * (older - newer);
+}
+
+static inline void delay_line_advance(struct delay_line *line, unsigned long count)
+{
+  line->cursor += count;
+  line->written = count < delay_line_size(line) - line->written ?
+                  line->written + count : delay_line_size(line);
+}
+
+static inline void delay_line_write(struct delay_line *line, LADSPA_Data value)
+{
+  *delay_line_at(line, line->cursor) = value;
+  delay_line_advance(line, 1);
+}
+
+/* Writes a block of samples, split where it wraps */
+static inline void delay_line_write_block(struct delay_line *line, const LADSPA_Data *in, unsigned long count)
+{
+  while (count > 0) {
+    const unsigned long contiguous = delay_line_contiguous(line, line->cursor);
+    const unsigned long n = count < contiguous ? count : contiguous;
+
+    memcpy(delay_line_at(line, line->cursor), in, sizeof(*in) * n);
+    delay_line_advance(line, n);
+    in += n;
+    count -= n;
+  }
+}
+
+/* Records that count frames were just written, of which the last trailing
+ * were silent */
+static inline void delay_line_note_silence(struct delay_line *line, unsigned long count, unsigned long trailing)
+{
+  line->silent = trailing < count ? trailing : line->silent + count;
+}
+
+/* Whether every frame in the ring is silent */
+static inline int delay_line_is_silent(const struct delay_line *line)
+{
+  return line->silent >= delay_line_size(line);
+}
+
+/* Moves the cursor along instead of writing count silent frames, leaving
+ * whatever silence the line already holds in their place */
+static inline void delay_line_skip(struct delay_line *line, unsigned long count)
+{
+  line->silent += count;
+  delay_line_advance(line, count);
+}
+
+static inline stereo_frame *stereo_delay_line_at(const struct delay_line *line, unsigned long position)
+{
+  return &line->frames[delay_line_index(line, position)];
+}
+
+/* Left lane from l_delay frames before position, right lane from r_delay
+ * frames before it */
+static inline stereo_frame stereo_delay_line_tap(const struct delay_line *line,
+                                                 unsigned long position,
+                                                 unsigned long l_delay,
+                                                 unsigned long r_delay)
+{
+  const stereo_frame left = *stereo_delay_line_at(line, position - l_delay);
+  if (l_delay == r_delay)
+    return left;
+
+  const stereo_frame right = *stereo_delay_line_at(line, position - r_delay);
+  return __builtin_shuffle(left, right, (stereo_mask) {0, 3});
+}
+
+static inline void stereo_delay_line_write(struct delay_line *line, stereo_frame frame)
+{
+  *stereo_delay_line_at(line, line->cursor) = frame;
+  delay_line_advance(line, 1);
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef DENORMAL_H
+#define DENORMAL_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <xmmintrin.h>
+#endif
+
+#include "ladspa.h"
+
+/* Feedback paths that decay towards silence end up in subnormal floats,
+ * which many CPUs process tens of times slower than normal ones. While a
+ * guard is held, subnormal results are flushed to zero and subnormal
+ * inputs read as zero. The host's floating point mode is saved when the
+ * guard is entered and restored when it is left, so run() can hold one
+ * without affecting the code that called it. */
+struct denormal_guard {
+  unsigned long    saved;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Flush to zero and denormals are zero in MXCSR */
+#define DENORMAL_MODE_BITS 0x8040ul
+
+static inline struct denormal_guard denormal_guard_enter(void)
+{
+  const struct denormal_guard guard = {_mm_getcsr()};
+  _mm_setcsr((unsigned int) (guard.saved | DENORMAL_MODE_BITS));
+  return guard;
+}
+
+static inline void denormal_guard_leave(struct denormal_guard guard)
+{
+  _mm_setcsr((unsigned int) guard.saved);
+}
+
+#elif defined(__aarch64__)
+
+/* Flush to zero in FPCR, which covers both inputs and results */
+#define DENORMAL_MODE_BITS (1ul << 24)
+
+static inline struct denormal_guard denormal_guard_enter(void)
+{
+  struct denormal_guard guard;
+  __asm__ volatile ("mrs %0, fpcr" : "=r" (guard.saved));
+  __asm__ volatile ("msr fpcr, %0" : : "r" (guard.saved | DENORMAL_MODE_BITS));
+  return guard;
+}
+
+static inline void denormal_guard_leave(struct denormal_guard guard)
+{
+  __asm__ volatile ("msr fpcr, %0" : : "r" (guard.saved));
+}
+
+#else
+
+/* Elsewhere only the thresholds below keep state out of the subnormals */
+static inline struct denormal_guard denormal_guard_enter(void)
+{
+  return (struct denormal_guard) {0};
+}
+
+static inline void denormal_guard_leave(struct denormal_guard guard)
+{
+  (void) guard;
+}
+
+#endif
+
+/* Far below anything audible, and far above the subnormals, so that state
+ * carried from one block to the next stops decaying once it gets here */
+#define DENORMAL_THRESHOLD 1e-20f
+
+static inline LADSPA_Data flush_denormal(LADSPA_Data value)
+{
+  return value > -DENORMAL_THRESHOLD && value < DENORMAL_THRESHOLD ? 0.f : value;
+}
+
+#endif
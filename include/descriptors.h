@@ -2,6 +2,7 @@
 #define DESCRIPTORS_H
 
 #include "ladspa.h"
+#include "batch.h"
 
 enum {
   UID_ORBIT = 1,
@@ -10,10 +11,30 @@ enum {
   UID_GRANULAR,
 };
 
+/* Each plugin is compiled once for the baseline instruction set and, on
+ * x86-64, once more for each microarchitecture level, with ISA defined to
+ * the level. DESCRIPTOR() gives each copy of a descriptor its own name:
+ * orbit_descriptor for the baseline, orbit_descriptor_v3 for x86-64-v3. */
+#define DESCRIPTOR_PASTE_(name, isa) name##_descriptor_##isa
+#define DESCRIPTOR_PASTE(name, isa) DESCRIPTOR_PASTE_(name, isa)
+
+#ifdef ISA
+#define DESCRIPTOR(name) DESCRIPTOR_PASTE(name, ISA)
+#else
+#define DESCRIPTOR(name) name##_descriptor
+#endif
+
+/* Same for the batch versions: orbit_batch_descriptor, and so on */
+#define BATCH_DESCRIPTOR(name) DESCRIPTOR(name##_batch)
+
 extern const LADSPA_Descriptor
   orbit_descriptor,
   delay_descriptor,
   orbital_delay_descriptor,
   granular_descriptor;
 
+extern const LLP_Batch_Descriptor
+  orbit_batch_descriptor,
+  delay_batch_descriptor;
+
 #endif
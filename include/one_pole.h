@@ -0,0 +1,77 @@
+#ifndef ONE_POLE_H
+#define ONE_POLE_H
+
+#include <string.h>
+
+#include "ladspa.h"
+#include "denormal.h"
+
+/* One-pole low-pass, y[n] = c * x[n] + (1 - c) * y[n - 1], filtered in
+ * place a block at a time. Four outputs are computed at once: within a
+ * group the recurrence is unrolled into a prefix sum across the lanes, so
+ * the only serial dependency left is carrying the last output of one group
+ * into the next. */
+typedef LADSPA_Data one_pole_vector __attribute__((vector_size(4 * sizeof(LADSPA_Data))));
+typedef int one_pole_mask __attribute__((vector_size(4 * sizeof(int))));
+
+struct one_pole {
+  LADSPA_Data      coefficient;
+  LADSPA_Data      decay;
+
+  /* Decay over one to four samples, for carrying the state into a group */
+  one_pole_vector  decays;
+
+  LADSPA_Data      state;
+};
+
+static inline void one_pole_init(struct one_pole *filter)
+{
+  filter->coefficient = 1.f;
+  filter->decay = 0.f;
+  filter->decays = (one_pole_vector) {0.f, 0.f, 0.f, 0.f};
+  filter->state = 0.f;
+}
+
+static inline void one_pole_set(struct one_pole *filter, LADSPA_Data coefficient)
+{
+  if (coefficient == filter->coefficient)
+    return;
+
+  const LADSPA_Data decay = 1.f - coefficient;
+
+  filter->coefficient = coefficient;
+  filter->decay = decay;
+  filter->decays = (one_pole_vector) {decay, decay * decay, decay * decay * decay, decay * decay * decay * decay};
+}
+
+static inline void one_pole_process(struct one_pole *filter, LADSPA_Data *data, unsigned long count)
+{
+  const LADSPA_Data c = filter->coefficient;
+  const LADSPA_Data a = filter->decay;
+  const LADSPA_Data a2 = a * a;
+  const one_pole_vector zero = {0.f, 0.f, 0.f, 0.f};
+  LADSPA_Data y = filter->state;
+
+  unsigned long i = 0;
+  for (; i + 4 <= count; i += 4) {
+    one_pole_vector v;
+    memcpy(&v, &data[i], sizeof(v));
+
+    v *= c;
+    v += a * __builtin_shuffle(v, zero, (one_pole_mask) {4, 0, 1, 2});
+    v += a2 * __builtin_shuffle(v, zero, (one_pole_mask) {4, 4, 0, 1});
+    v += filter->decays * y;
+
+    memcpy(&data[i], &v, sizeof(v));
+    y = v[3];
+  }
+
+  for (; i < count; ++i)
+    y = data[i] = c * data[i] + a * y;
+
+  /* Silence would otherwise leave the state decaying through the
+   * subnormals */
+  filter->state = flush_denormal(y);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef PHASOR_H
+#define PHASOR_H
+
+#include <math.h>
+
+#include "ladspa.h"
+
+/* Number of interleaved rotations in phasor_fill(). Each output sample is
+ * rotated from the one PHASOR_LANES samples before it, so the loop has no
+ * dependency shorter than that and can be vectorized. */
+#define PHASOR_LANES 8
+
+/* Generates cos/sin of an angle that advances by a fixed step per sample,
+ * using complex rotation instead of calling the trigonometric functions */
+struct phasor {
+  LADSPA_Data      step_re;
+  LADSPA_Data      step_im;
+  LADSPA_Data      lane_re;
+  LADSPA_Data      lane_im;
+};
+
+static inline void phasor_init(struct phasor *phasor, double step)
+{
+  phasor->step_re = (LADSPA_Data) cos(step);
+  phasor->step_im = (LADSPA_Data) sin(step);
+  phasor->lane_re = (LADSPA_Data) cos(step * PHASOR_LANES);
+  phasor->lane_im = (LADSPA_Data) sin(step * PHASOR_LANES);
+}
+
+/* Writes cos and sin of start + k * step to re[k] and im[k] for k < count.
+ * Only the start angle is evaluated exactly, so count should be kept short
+ * enough that rounding errors don't build up, e.g. a few times the number
+ * of lanes. */
+static inline void phasor_fill(const struct phasor *phasor,
+                               LADSPA_Data *restrict re,
+                               LADSPA_Data *restrict im,
+                               unsigned long count,
+                               double start)
+{
+  if (count == 0)
+    return;
+
+  re[0] = (LADSPA_Data) cos(start);
+  im[0] = (LADSPA_Data) sin(start);
+
+  const unsigned long seeds = count < PHASOR_LANES ? count : PHASOR_LANES;
+  for (unsigned long k = 1; k < seeds; ++k) {
+    re[k] = re[k - 1] * phasor->step_re - im[k - 1] * phasor->step_im;
+    im[k] = re[k - 1] * phasor->step_im + im[k - 1] * phasor->step_re;
+  }
+
+  for (unsigned long k = PHASOR_LANES; k < count; ++k) {
+    re[k] = re[k - PHASOR_LANES] * phasor->lane_re - im[k - PHASOR_LANES] * phasor->lane_im;
+    im[k] = re[k - PHASOR_LANES] * phasor->lane_im + im[k - PHASOR_LANES] * phasor->lane_re;
+  }
+}
+
+#endif
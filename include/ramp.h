@@ -0,0 +1,71 @@
+#ifndef RAMP_H
+#define RAMP_H
+
+#include <math.h>
+
+#include "ladspa.h"
+
+/* Longest piece of a ramp generated at once, so that ramps fit in arrays
+ * on the stack */
+#define RAMP_CHUNK_SIZE 256
+
+/* Ramps move a control from the value the last block ended on to the value
+ * on its port over the length of a block, instead of stepping at the start
+ * of it. A ramp is generated a piece at a time: ramp[k] is the value at
+ * sample start + k of the block, and the last sample of the block lands
+ * exactly on the target. */
+static inline void ramp_linear(LADSPA_Data *ramp,
+                               unsigned long count,
+                               LADSPA_Data from,
+                               LADSPA_Data to,
+                               unsigned long start,
+                               unsigned long length)
+{
+  const LADSPA_Data step = (to - from) / (LADSPA_Data) length;
+
+  for (unsigned long k = 0; k < count; ++k) {
+    const unsigned long n = start + k + 1;
+    ramp[k] = n >= length ? to : from + step * (LADSPA_Data) n;
+  }
+}
+
+/* Samples between the values of an exponential ramp that are evaluated
+ * exactly. Seeding at fixed positions in the block, rather than at the
+ * start of each piece, makes the rounding of the values in between the same
+ * whether a block is generated in one piece, split at a delay line wrap, or
+ * split into batch chunks. */
+#define RAMP_SEED_INTERVAL 32
+
+/* Ramp with a constant ratio between samples, which sounds even for gains.
+ * Falls back to a linear ramp when either end isn't positive. Values in
+ * between exact ones are multiplied along from the last exact one, so they
+ * don't depend on how the block is split into pieces. */
+static inline void ramp_exponential(LADSPA_Data *ramp,
+                                    unsigned long count,
+                                    LADSPA_Data from,
+                                    LADSPA_Data to,
+                                    unsigned long start,
+                                    unsigned long length)
+{
+  if (!(from > 0.f && to > 0.f)) {
+    ramp_linear(ramp, count, from, to, start, length);
+    return;
+  }
+
+  const double ratio = log((double) to / (double) from) / (double) length;
+  const LADSPA_Data step = (LADSPA_Data) exp(ratio);
+
+  unsigned long n = (start + 1) / RAMP_SEED_INTERVAL * RAMP_SEED_INTERVAL;
+  LADSPA_Data value = (LADSPA_Data) ((double) from * exp(ratio * (double) n));
+  for (; n < start + 1; ++n)
+    value *= step;
+
+  for (unsigned long k = 0; k < count; ++k, ++n) {
+    if (n % RAMP_SEED_INTERVAL == 0)
+      value = (LADSPA_Data) ((double) from * exp(ratio * (double) n));
+    ramp[k] = n >= length ? to : value;
+    value *= step;
+  }
+}
+
+#endif
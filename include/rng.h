@@ -0,0 +1,75 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* xoshiro128** pseudo random number generator. Small enough to keep one per
+ * instance, so instances never share state or take a lock. */
+struct rng {
+  uint32_t         state[4];
+};
+
+static inline uint64_t rng_splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline void rng_seed(struct rng *rng, uint64_t seed)
+{
+  const uint64_t a = rng_splitmix64(&seed);
+  const uint64_t b = rng_splitmix64(&seed);
+
+  rng->state[0] = (uint32_t) a;
+  rng->state[1] = (uint32_t) (a >> 32);
+  rng->state[2] = (uint32_t) b;
+  rng->state[3] = (uint32_t) (b >> 32);
+}
+
+static inline uint32_t rng_rotl(uint32_t x, int k)
+{
+  return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t rng_next(struct rng *rng)
+{
+  uint32_t *const s = rng->state;
+  const uint32_t result = rng_rotl(s[1] * 5, 7) * 9;
+  const uint32_t t = s[1] << 9;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rng_rotl(s[3], 11);
+
+  return result;
+}
+
+/* Uniform integer in [0, range), without modulo bias (Lemire's method) */
+static inline uint32_t rng_range(struct rng *rng, uint32_t range)
+{
+  uint64_t m = (uint64_t) rng_next(rng) * range;
+  uint32_t low = (uint32_t) m;
+
+  if (low < range) {
+    const uint32_t threshold = -range % range;
+    while (low < threshold) {
+      m = (uint64_t) rng_next(rng) * range;
+      low = (uint32_t) m;
+    }
+  }
+
+  return (uint32_t) (m >> 32);
+}
+
+/* Uniform float in [0, 1) */
+static inline float rng_float(struct rng *rng)
+{
+  return (float) (rng_next(rng) >> 8) * (1.f / 16777216.f);
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "ladspa.h"
+
 #define MAKER "Ludvig Gunne Lindström"
 #define COPYRIGHT "None"
 
@@ -16,4 +18,94 @@
     .UpperBound = max,                                  \
   }
 
+/* How a kernel stores its result: run() replaces the contents of the
+ * output buffers, run_adding() adds to them, scaled by the run adding gain.
+ * Kernels take the mode as a constant so each caller gets its own copy of
+ * the loop with the branch folded away. */
+enum output_mode {
+  OUTPUT_REPLACE,
+  OUTPUT_ADD,
+};
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/* Largest number of ports a plugin using a control cache may have */
+#define CONTROL_CACHE_SIZE 32
+
+/* The values control ports had when the values derived from them were
+ * last computed, indexed by port. run() checks the ports it derives
+ * values from against the cache, and only recomputes them when one has
+ * changed, which keeps conversions and divisions out of the steady state. */
+struct control_cache {
+  LADSPA_Data      values[CONTROL_CACHE_SIZE];
+};
+
+/* Makes the next update report every port as changed. Call from
+ * activate(). */
+static inline void control_cache_invalidate(struct control_cache *cache)
+{
+  for (unsigned long p = 0; p < CONTROL_CACHE_SIZE; ++p)
+    cache->values[p] = __builtin_nanf("");
+}
+
+/* Records the current values of count ports, and returns whether any of
+ * them differ from the recorded ones. A port holding NaN always counts as
+ * changed. */
+static inline int control_cache_update(struct control_cache *cache,
+                                       LADSPA_Data *const *ports,
+                                       const unsigned long *indices,
+                                       unsigned long count)
+{
+  int changed = 0;
+  for (unsigned long i = 0; i < count; ++i) {
+    const LADSPA_Data value = *ports[indices[i]];
+    changed |= value != cache->values[indices[i]];
+    cache->values[indices[i]] = value;
+  }
+  return changed;
+}
+
+static ALWAYS_INLINE void write_output(LADSPA_Data *out,
+                                       LADSPA_Data value,
+                                       enum output_mode mode,
+                                       LADSPA_Data gain)
+{
+  if (mode == OUTPUT_ADD)
+    *out += gain * value;
+  else
+    *out = value;
+}
+
+/* Samples smaller than this count as silence: they are below the least
+ * significant bit of 24-bit audio. Feedback takes a long time to decay all
+ * the way to zero, but not to this. */
+#define SILENCE_THRESHOLD (1.f / 16777216.f)
+
+static inline int is_silent(LADSPA_Data sample)
+{
+  return sample * sample < SILENCE_THRESHOLD * SILENCE_THRESHOLD;
+}
+
+/* Number of samples at the end of data that are silent. Sound usually
+ * shows in the last sample, and silence usually lasts the whole block, so
+ * those two cases are checked first, the second one without branches so
+ * that it vectorizes. */
+static inline unsigned long trailing_silence(const LADSPA_Data *data, unsigned long count)
+{
+  if (count == 0 || !is_silent(data[count - 1]))
+    return 0;
+
+  int loud = 0;
+  for (unsigned long k = 0; k < count; ++k)
+    loud |= !is_silent(data[k]);
+  if (!loud)
+    return count;
+
+  unsigned long n = count - 1;
+  while (is_silent(data[n - 1]))
+    --n;
+
+  return count - n;
+}
+
 #endif
@@ -0,0 +1,52 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+
+size_t arena_reserve(struct arena *arena, size_t size)
+{
+  const size_t offset = arena->size;
+  arena->size += (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  return offset;
+}
+
+int mlock_requested(void)
+{
+  const char *const value = getenv("LLP_MLOCK");
+  return value != NULL && *value != '\0' && strcmp(value, "0") != 0;
+}
+
+int arena_allocate(struct arena *arena)
+{
+  const long page_size = sysconf(_SC_PAGESIZE);
+  const size_t alignment = page_size > CACHE_LINE_SIZE ? (size_t) page_size : CACHE_LINE_SIZE;
+
+  /* aligned_alloc() wants a whole number of alignments */
+  arena->size = (arena->size + alignment - 1) / alignment * alignment;
+  arena->base = aligned_alloc(alignment, arena->size);
+  if (arena->base == NULL)
+    return -1;
+
+  memset(arena->base, 0, arena->size);
+
+  /* Locking may fail with a low RLIMIT_MEMLOCK, in which case the pages
+   * are still faulted in by the memset, just not pinned */
+  arena->locked = mlock_requested() && mlock(arena->base, arena->size) == 0;
+
+  return 0;
+}
+
+void arena_free(struct arena *arena)
+{
+  /* The arena usually lives inside its own memory */
+  const struct arena copy = *arena;
+
+  if (copy.locked)
+    munlock(copy.base, copy.size);
+
+  free(copy.base);
+}
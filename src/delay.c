@@ -7,8 +7,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "ladspa.h"
+#include "arena.h"
+#include "delay_line.h"
+#include "denormal.h"
 #include "descriptors.h"
+#include "ramp.h"
 #include "utils.h"
 
 enum {
@@ -18,6 +28,7 @@ enum {
   PORT_FEEDBACK,
   PORT_GAIN,
   PORT_WETDRYMIX,
+  PORT_IDLE,
   _PORT_COUNT,
 };
 
@@ -28,6 +39,7 @@ static const LADSPA_PortDescriptor port_descriptors[_PORT_COUNT] = {
   [PORT_FEEDBACK]     = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
   [PORT_GAIN]         = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
   [PORT_WETDRYMIX]    = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
+  [PORT_IDLE]         = LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL,
 };
 
 static const char *const port_names[_PORT_COUNT] = {
@@ -37,6 +49,7 @@ static const char *const port_names[_PORT_COUNT] = {
   [PORT_FEEDBACK]     = "Feedback",
   [PORT_GAIN]         = "Gain",
   [PORT_WETDRYMIX]    = "Wet/dry mix",
+  [PORT_IDLE]         = "Idle",
 };
 
 static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
@@ -46,25 +59,85 @@ static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
   [PORT_FEEDBACK] = PORT_RANGE_HINTS_BOUNDED_FLOAT(0.f, 1.f, 0),
   [PORT_GAIN] = PORT_RANGE_HINTS_BOUNDED_FLOAT(0.f, 1.f, 0),
   [PORT_WETDRYMIX] = PORT_RANGE_HINTS_BOUNDED_FLOAT(0.f, 1.f, 0),
+  [PORT_IDLE] = {.HintDescriptor = LADSPA_HINT_TOGGLED},
+};
+
+/* Processes a span of samples where neither the read nor the write
+ * position wraps around the end of the buffer. Each input sample is read
+ * before the output sample at the same index is written, so in and out may
+ * be the same buffer. */
+typedef void (*kernel_function)(LADSPA_Data *out,
+                                LADSPA_Data *write,
+                                const LADSPA_Data *read,
+                                const LADSPA_Data *in,
+                                unsigned long count,
+                                LADSPA_Data gain,
+                                LADSPA_Data feedback,
+                                LADSPA_Data wetdrymix,
+                                LADSPA_Data adding_gain);
+
+struct kernel {
+  kernel_function  run;
+  kernel_function  run_adding;
 };
 
+/* Ports the tap offset is derived from */
+static const unsigned long offset_ports[] = {PORT_DELAY};
+
+_Static_assert(_PORT_COUNT <= CONTROL_CACHE_SIZE, "too many ports for the control cache");
+
 struct instance {
   unsigned long    sample_rate;
   LADSPA_Data     *ports[_PORT_COUNT];
-  LADSPA_Data     *buffer;
-  unsigned long    buffer_size;
-  unsigned long    cursor;
+  struct delay_line line;
+  unsigned long    max_offset;
+  LADSPA_Data      run_adding_gain;
+
+  /* Tap offset, for the delay it was last run with */
+  struct control_cache controls;
+  unsigned long    offset;
+
+  /* Values the last block ended on, which the next block ramps from. Not
+   * valid until the first block after activate(). */
+  int              ramps_valid;
+  unsigned long    ramp_offset;
+  LADSPA_Data      ramp_gain;
+  LADSPA_Data      ramp_wetdrymix;
+
+  const struct kernel *kernel;
+  struct arena     arena;
+};
+
+/* Most frames a batch transposes at once */
+#define BATCH_CHUNK_SIZE 32
+
+/* Channels of Delay sharing their controls. The instance holds the
+ * controls and a delay line whose frames hold a sample of every channel;
+ * its audio ports are not used. */
+struct batch {
+  struct instance  instance;
+  unsigned long    channels;
+  const LADSPA_Data **inputs;
+  LADSPA_Data    **outputs;
+
+  /* A chunk of the inputs and outputs, transposed to one frame per sample */
+  LADSPA_Data     *in_frames;
+  LADSPA_Data     *out_frames;
 };
 
 static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate);
 static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data *data_location);
+static void activate(LADSPA_Handle instance);
 static void run(LADSPA_Handle instance, unsigned long sample_count);
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count);
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain);
+static void deactivate(LADSPA_Handle instance);
 static void cleanup(LADSPA_Handle instance);
 
-const LADSPA_Descriptor delay_descriptor = {
+const LADSPA_Descriptor DESCRIPTOR(delay) = {
   .UniqueID               = UID_DELAY,
   .Label                  = "audio",
-  .Properties             = 0,
+  .Properties             = LADSPA_PROPERTY_HARD_RT_CAPABLE,
   .Name                   = "Delay",
   .Maker                  = MAKER,
   .Copyright              = COPYRIGHT,
@@ -75,32 +148,298 @@ const LADSPA_Descriptor delay_descriptor = {
   .ImplementationData     = NULL,
   .instantiate            = instantiate,
   .connect_port           = connect_port,
-  .activate               = NULL,
+  .activate               = activate,
   .run                    = run,
-  .run_adding             = NULL,
-  .set_run_adding_gain    = NULL,
-  .deactivate             = NULL,
+  .run_adding             = run_adding,
+  .set_run_adding_gain    = set_run_adding_gain,
+  .deactivate             = deactivate,
   .cleanup                = cleanup,
 };
 
-static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate)
+static LADSPA_Handle batch_instantiate(const LLP_Batch_Descriptor *descriptor,
+                                       unsigned long sample_rate,
+                                       unsigned long channels);
+static void batch_connect_port(LADSPA_Handle batch, unsigned long port, unsigned long channel, LADSPA_Data *data_location);
+static void batch_activate(LADSPA_Handle batch);
+static void batch_run(LADSPA_Handle batch, unsigned long sample_count);
+static void batch_deactivate(LADSPA_Handle batch);
+static void batch_cleanup(LADSPA_Handle batch);
+
+const LLP_Batch_Descriptor BATCH_DESCRIPTOR(delay) = {
+  .Descriptor             = &DESCRIPTOR(delay),
+  .instantiate            = batch_instantiate,
+  .connect_port           = batch_connect_port,
+  .activate               = batch_activate,
+  .deactivate             = batch_deactivate,
+  .run                    = batch_run,
+  .cleanup                = batch_cleanup,
+};
+
+/* Instantiates the run() and run_adding() versions of a span kernel */
+#define DEFINE_KERNEL(name, attributes)                                                    \
+  attributes static void name##_run(LADSPA_Data *out,                                      \
+                                    LADSPA_Data *write,                                    \
+                                    const LADSPA_Data *read,                               \
+                                    const LADSPA_Data *in,                                 \
+                                    unsigned long count,                                   \
+                                    LADSPA_Data gain,                                      \
+                                    LADSPA_Data feedback,                                  \
+                                    LADSPA_Data wetdrymix,                                 \
+                                    LADSPA_Data adding_gain)                               \
+  {                                                                                        \
+    name(out, write, read, in, count, gain, feedback, wetdrymix,                           \
+         OUTPUT_REPLACE, adding_gain);                                                     \
+  }                                                                                        \
+                                                                                           \
+  attributes static void name##_run_adding(LADSPA_Data *out,                               \
+                                           LADSPA_Data *write,                             \
+                                           const LADSPA_Data *read,                        \
+                                           const LADSPA_Data *in,                          \
+                                           unsigned long count,                            \
+                                           LADSPA_Data gain,                               \
+                                           LADSPA_Data feedback,                           \
+                                           LADSPA_Data wetdrymix,                          \
+                                           LADSPA_Data adding_gain)                        \
+  {                                                                                        \
+    name(out, write, read, in, count, gain, feedback, wetdrymix,                           \
+         OUTPUT_ADD, adding_gain);                                                         \
+  }                                                                                        \
+                                                                                           \
+  static const struct kernel kernel_##name = {                                             \
+    .run        = name##_run,                                                              \
+    .run_adding = name##_run_adding,                                                       \
+  }
+
+/* Reference implementation, also inlined for the tails of the vector kernels
+ * so that they never mix legacy SSE and AVX encodings. What is written back
+ * is flushed to zero below DENORMAL_THRESHOLD, so that feedback stops
+ * decaying there instead of carrying subnormals around the line, on CPUs
+ * without a flush-to-zero mode too. */
+static ALWAYS_INLINE void span_scalar(LADSPA_Data *out,
+                                      LADSPA_Data *write,
+                                      const LADSPA_Data *read,
+                                      const LADSPA_Data *in,
+                                      unsigned long count,
+                                      LADSPA_Data gain,
+                                      LADSPA_Data feedback,
+                                      LADSPA_Data wetdrymix,
+                                      enum output_mode mode,
+                                      LADSPA_Data adding_gain)
 {
-  struct instance *const instance_ = calloc(1, sizeof(*instance_));
-  if (instance_ == NULL)
-    return NULL;
+  for (unsigned long i = 0; i < count; ++i) {
+    LADSPA_Data mix = read[i];
+    mix *= gain;
+    mix = wetdrymix * in[i] + (1.f - wetdrymix) * mix;
+
+    write[i] = flush_denormal(in[i] + feedback * mix);
+    write_output(&out[i], mix, mode, adding_gain);
+  }
+}
+
+DEFINE_KERNEL(span_scalar, );
+
+#if defined(__x86_64__)
+
+static ALWAYS_INLINE void span_sse(LADSPA_Data *out,
+                                   LADSPA_Data *write,
+                                   const LADSPA_Data *read,
+                                   const LADSPA_Data *in,
+                                   unsigned long count,
+                                   LADSPA_Data gain,
+                                   LADSPA_Data feedback,
+                                   LADSPA_Data wetdrymix,
+                                   enum output_mode mode,
+                                   LADSPA_Data adding_gain)
+{
+  const __m128 g = _mm_set1_ps(gain);
+  const __m128 f = _mm_set1_ps(feedback);
+  const __m128 w = _mm_set1_ps(wetdrymix);
+  const __m128 d = _mm_set1_ps(1.f - wetdrymix);
+  const __m128 a = _mm_set1_ps(adding_gain);
+  const __m128 t = _mm_set1_ps(DENORMAL_THRESHOLD);
+  const __m128 sign = _mm_set1_ps(-0.f);
+
+  unsigned long i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128 x = _mm_loadu_ps(&in[i]);
+    __m128 mix = _mm_mul_ps(_mm_loadu_ps(&read[i]), g);
+    mix = _mm_add_ps(_mm_mul_ps(w, x), _mm_mul_ps(d, mix));
+
+    /* flush_denormal(): clear the lanes whose magnitude is below the
+     * threshold */
+    const __m128 y = _mm_add_ps(x, _mm_mul_ps(f, mix));
+    _mm_storeu_ps(&write[i], _mm_andnot_ps(_mm_cmplt_ps(_mm_andnot_ps(sign, y), t), y));
+
+    if (mode == OUTPUT_ADD)
+      mix = _mm_add_ps(_mm_loadu_ps(&out[i]), _mm_mul_ps(a, mix));
+    _mm_storeu_ps(&out[i], mix);
+  }
+
+  span_scalar(&out[i], &write[i], &read[i], &in[i], count - i,
+              gain, feedback, wetdrymix, mode, adding_gain);
+}
+
+DEFINE_KERNEL(span_sse, );
+
+__attribute__((target("avx2")))
+static ALWAYS_INLINE void span_avx2(LADSPA_Data *out,
+                                    LADSPA_Data *write,
+                                    const LADSPA_Data *read,
+                                    const LADSPA_Data *in,
+                                    unsigned long count,
+                                    LADSPA_Data gain,
+                                    LADSPA_Data feedback,
+                                    LADSPA_Data wetdrymix,
+                                    enum output_mode mode,
+                                    LADSPA_Data adding_gain)
+{
+  const __m256 g = _mm256_set1_ps(gain);
+  const __m256 f = _mm256_set1_ps(feedback);
+  const __m256 w = _mm256_set1_ps(wetdrymix);
+  const __m256 d = _mm256_set1_ps(1.f - wetdrymix);
+  const __m256 a = _mm256_set1_ps(adding_gain);
+  const __m256 t = _mm256_set1_ps(DENORMAL_THRESHOLD);
+  const __m256 sign = _mm256_set1_ps(-0.f);
+
+  unsigned long i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 x = _mm256_loadu_ps(&in[i]);
+    __m256 mix = _mm256_mul_ps(_mm256_loadu_ps(&read[i]), g);
+    mix = _mm256_add_ps(_mm256_mul_ps(w, x), _mm256_mul_ps(d, mix));
+
+    const __m256 y = _mm256_add_ps(x, _mm256_mul_ps(f, mix));
+    const __m256 small = _mm256_cmp_ps(_mm256_andnot_ps(sign, y), t, _CMP_LT_OQ);
+    _mm256_storeu_ps(&write[i], _mm256_andnot_ps(small, y));
+
+    if (mode == OUTPUT_ADD)
+      mix = _mm256_add_ps(_mm256_loadu_ps(&out[i]), _mm256_mul_ps(a, mix));
+    _mm256_storeu_ps(&out[i], mix);
+  }
+
+  span_scalar(&out[i], &write[i], &read[i], &in[i], count - i,
+              gain, feedback, wetdrymix, mode, adding_gain);
+}
+
+DEFINE_KERNEL(span_avx2, __attribute__((target("avx2"))));
+
+#elif defined(__ARM_NEON)
+
+static ALWAYS_INLINE void span_neon(LADSPA_Data *out,
+                                    LADSPA_Data *write,
+                                    const LADSPA_Data *read,
+                                    const LADSPA_Data *in,
+                                    unsigned long count,
+                                    LADSPA_Data gain,
+                                    LADSPA_Data feedback,
+                                    LADSPA_Data wetdrymix,
+                                    enum output_mode mode,
+                                    LADSPA_Data adding_gain)
+{
+  const float32x4_t g = vdupq_n_f32(gain);
+  const float32x4_t f = vdupq_n_f32(feedback);
+  const float32x4_t w = vdupq_n_f32(wetdrymix);
+  const float32x4_t d = vdupq_n_f32(1.f - wetdrymix);
+  const float32x4_t a = vdupq_n_f32(adding_gain);
+  const float32x4_t t = vdupq_n_f32(DENORMAL_THRESHOLD);
+
+  unsigned long i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const float32x4_t x = vld1q_f32(&in[i]);
+    float32x4_t mix = vmulq_f32(vld1q_f32(&read[i]), g);
+    mix = vaddq_f32(vmulq_f32(w, x), vmulq_f32(d, mix));
+
+    const float32x4_t y = vaddq_f32(x, vmulq_f32(f, mix));
+    const uint32x4_t small = vcltq_f32(vabsq_f32(y), t);
+    vst1q_f32(&write[i], vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(y), small)));
+
+    if (mode == OUTPUT_ADD)
+      mix = vaddq_f32(vld1q_f32(&out[i]), vmulq_f32(a, mix));
+    vst1q_f32(&out[i], mix);
+  }
+
+  span_scalar(&out[i], &write[i], &read[i], &in[i], count - i,
+              gain, feedback, wetdrymix, mode, adding_gain);
+}
+
+DEFINE_KERNEL(span_neon, );
+
+#endif
+
+/* Kernel for blocks where the controls move. Gain and wet/dry mix follow
+ * ramps, and the delay crossfades from a head at the old delay to one at the
+ * new delay. A head whose scale is zero reads as silence. */
+static ALWAYS_INLINE void span_ramped(LADSPA_Data *out,
+                                      LADSPA_Data *write,
+                                      const LADSPA_Data *from,
+                                      const LADSPA_Data *to,
+                                      const LADSPA_Data *in,
+                                      unsigned long count,
+                                      LADSPA_Data from_scale,
+                                      LADSPA_Data to_scale,
+                                      const LADSPA_Data *fades,
+                                      const LADSPA_Data *gains,
+                                      LADSPA_Data feedback,
+                                      const LADSPA_Data *wetdrymixes,
+                                      enum output_mode mode,
+                                      LADSPA_Data adding_gain)
+{
+  for (unsigned long i = 0; i < count; ++i) {
+    const LADSPA_Data old = from_scale * from[i];
+    LADSPA_Data mix = old + fades[i] * (to_scale * to[i] - old);
+    mix *= gains[i];
+    mix = wetdrymixes[i] * in[i] + (1.f - wetdrymixes[i]) * mix;
+
+    write[i] = flush_denormal(in[i] + feedback * mix);
+    write_output(&out[i], mix, mode, adding_gain);
+  }
+}
+
+/* Picks the widest kernel the CPU supports. The vector kernels avoid fused
+ * multiply-adds so they produce the same output as the scalar one. Setting
+ * LLP_KERNEL=scalar (or sse) in the environment forces a narrower kernel. */
+static const struct kernel *select_kernel(void)
+{
+  const char *const name = getenv("LLP_KERNEL");
+  if (name != NULL && strcmp(name, "scalar") == 0)
+    return &kernel_span_scalar;
+
+#if defined(__x86_64__)
+  if (name != NULL && strcmp(name, "sse") == 0)
+    return &kernel_span_sse;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return &kernel_span_avx2;
+  return &kernel_span_sse;
+#elif defined(__ARM_NEON)
+  return &kernel_span_neon;
+#endif
 
+  return &kernel_span_scalar;
+}
+
+static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate)
+{
   const LADSPA_Data max_delay = descriptor->PortRangeHints[PORT_DELAY].UpperBound;
-  instance_->buffer_size = 1 + (unsigned long) (max_delay * (LADSPA_Data) sample_rate);
-  instance_->buffer = malloc(sizeof(*instance_->buffer) * instance_->buffer_size);
-  if (instance_->buffer == NULL) {
-    free(instance_);
+  const unsigned long max_offset = (unsigned long) (max_delay * (LADSPA_Data) sample_rate);
+
+  struct arena arena = {0};
+  const size_t instance_offset = arena_reserve(&arena, sizeof(struct instance));
+  if (arena_allocate(&arena) < 0)
     return NULL;
-  }
 
-  memset(instance_->buffer, 0, sizeof(*instance_->buffer) * instance_->buffer_size);
+  struct instance *const instance_ = arena_at(&arena, instance_offset);
+  instance_->arena = arena;
 
+  if (delay_line_reserve(&instance_->line, max_offset + 1, sizeof(LADSPA_Data)) < 0) {
+    arena_free(&instance_->arena);
+    return NULL;
+  }
+  instance_->max_offset = max_offset;
   instance_->sample_rate = sample_rate;
-  instance_->cursor = 0;
+  instance_->run_adding_gain = 1.f;
+  instance_->kernel = select_kernel();
+  activate(instance_);
 
   return (LADSPA_Handle) instance_;
 }
@@ -111,41 +450,455 @@ static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data
   instance_->ports[port] = data_location;
 }
 
-static void run(LADSPA_Handle instance, unsigned long sample_count)
+/* Empties the delay line, clearing only what has been written since it
+ * was last cleared */
+static void activate(LADSPA_Handle instance)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+
+  delay_line_clear(&instance_->line);
+  control_cache_invalidate(&instance_->controls);
+  instance_->ramps_valid = 0;
+}
+
+/* Runs a block where the controls hold still */
+static ALWAYS_INLINE void run_steady(struct instance *instance_,
+                                     const LADSPA_Data *in,
+                                     LADSPA_Data *out,
+                                     unsigned long sample_count,
+                                     LADSPA_Data gain,
+                                     LADSPA_Data feedback,
+                                     LADSPA_Data wetdrymix,
+                                     enum output_mode mode)
+{
+  struct delay_line *const line = &instance_->line;
+  const unsigned long offset = instance_->offset;
+
+  /* Split the block into spans where neither the write position nor the
+   * tap wraps, and which are no longer than the delay so that a span never
+   * reads what it writes. A tap from before the first frame written reads
+   * as silence, in spans of its own that read the write position instead,
+   * with no gain. An offset of zero, which update_controls() never leaves,
+   * reads each frame just before it is overwritten and needs no limit. */
+  unsigned long i = 0;
+  while (i < sample_count) {
+    const unsigned long unwritten = delay_line_unwritten(line, offset, sample_count - i);
+    const int silent = unwritten > 0;
+    const unsigned long tap = line->cursor - (silent ? 0 : offset);
+
+    unsigned long count = silent ? unwritten : sample_count - i;
+    if (count > delay_line_contiguous(line, line->cursor))
+      count = delay_line_contiguous(line, line->cursor);
+    if (count > delay_line_contiguous(line, tap))
+      count = delay_line_contiguous(line, tap);
+    if (!silent && offset > 0 && count > offset)
+      count = offset;
+
+    const kernel_function kernel = mode == OUTPUT_ADD ?
+                                   instance_->kernel->run_adding :
+                                   instance_->kernel->run;
+
+    kernel(&out[i],
+           delay_line_at(line, line->cursor),
+           delay_line_at(line, tap),
+           &in[i],
+           count, silent ? 0.f : gain, feedback, wetdrymix,
+           instance_->run_adding_gain);
+
+    delay_line_note_silence(line, count, trailing_silence(delay_line_at(line, line->cursor), count));
+    delay_line_advance(line, count);
+    i += count;
+  }
+}
+
+/* Runs a block that moves from the values the last block ended on to the
+ * ones on the ports, in spans no longer than a ramp chunk where neither the
+ * write position nor either head wraps */
+static ALWAYS_INLINE void run_ramped(struct instance *instance_,
+                                     const LADSPA_Data *in,
+                                     LADSPA_Data *out,
+                                     unsigned long sample_count,
+                                     LADSPA_Data gain,
+                                     LADSPA_Data feedback,
+                                     LADSPA_Data wetdrymix,
+                                     enum output_mode mode)
+{
+  struct delay_line *const line = &instance_->line;
+  const unsigned long from_offset = instance_->ramp_offset;
+  const unsigned long to_offset = instance_->offset;
+
+  LADSPA_Data fades[RAMP_CHUNK_SIZE];
+  LADSPA_Data gains[RAMP_CHUNK_SIZE];
+  LADSPA_Data wetdrymixes[RAMP_CHUNK_SIZE];
+
+  unsigned long i = 0;
+  while (i < sample_count) {
+    unsigned long count = sample_count - i;
+    if (count > RAMP_CHUNK_SIZE)
+      count = RAMP_CHUNK_SIZE;
+
+    /* Heads from before the first frame written read as silence, as in
+     * run_steady() */
+    const unsigned long from_unwritten = delay_line_unwritten(line, from_offset, count);
+    const unsigned long to_unwritten = delay_line_unwritten(line, to_offset, count);
+    const int from_silent = from_unwritten > 0;
+    const int to_silent = to_unwritten > 0;
+    const unsigned long from_tap = line->cursor - (from_silent ? 0 : from_offset);
+    const unsigned long to_tap = line->cursor - (to_silent ? 0 : to_offset);
+
+    if (from_silent)
+      count = from_unwritten;
+    if (to_silent && count > to_unwritten)
+      count = to_unwritten;
+    if (count > delay_line_contiguous(line, line->cursor))
+      count = delay_line_contiguous(line, line->cursor);
+    if (count > delay_line_contiguous(line, from_tap))
+      count = delay_line_contiguous(line, from_tap);
+    if (count > delay_line_contiguous(line, to_tap))
+      count = delay_line_contiguous(line, to_tap);
+    if (!from_silent && from_offset > 0 && count > from_offset)
+      count = from_offset;
+    if (!to_silent && to_offset > 0 && count > to_offset)
+      count = to_offset;
+
+    ramp_linear(fades, count, 0.f, 1.f, i, sample_count);
+    ramp_exponential(gains, count, instance_->ramp_gain, gain, i, sample_count);
+    ramp_linear(wetdrymixes, count, instance_->ramp_wetdrymix, wetdrymix, i, sample_count);
+
+    span_ramped(&out[i],
+                delay_line_at(line, line->cursor),
+                delay_line_at(line, from_tap),
+                delay_line_at(line, to_tap),
+                &in[i],
+                count, from_silent ? 0.f : 1.f, to_silent ? 0.f : 1.f,
+                fades, gains, feedback, wetdrymixes,
+                mode, instance_->run_adding_gain);
+
+    delay_line_note_silence(line, count, trailing_silence(delay_line_at(line, line->cursor), count));
+    delay_line_advance(line, count);
+    i += count;
+  }
+}
+
+/* Derives the tap offset from the delay when it has changed, and returns
+ * whether the block has to ramp: controls that changed since the last block
+ * move over this one instead of stepping at its start */
+static int update_controls(struct instance *instance_)
+{
+  const LADSPA_Data gain      = *instance_->ports[PORT_GAIN];
+  const LADSPA_Data wetdrymix = *instance_->ports[PORT_WETDRYMIX];
+
+  /* A delay of zero is the longest one, max_offset + 1 frames, as far back
+   * as the line has to reach. Any other delay is at most max_offset. */
+  if (control_cache_update(&instance_->controls, instance_->ports, offset_ports,
+                           sizeof(offset_ports) / sizeof(*offset_ports))) {
+    unsigned long offset = (unsigned long) (*instance_->ports[PORT_DELAY] * (LADSPA_Data) instance_->sample_rate);
+    if (offset > instance_->max_offset)
+      offset = instance_->max_offset;
+    if (offset == 0)
+      offset = instance_->max_offset + 1;
+
+    instance_->offset = offset;
+  }
+
+  if (!instance_->ramps_valid) {
+    instance_->ramps_valid = 1;
+    instance_->ramp_offset = instance_->offset;
+    instance_->ramp_gain = gain;
+    instance_->ramp_wetdrymix = wetdrymix;
+  }
+
+  return instance_->offset != instance_->ramp_offset ||
+         gain != instance_->ramp_gain ||
+         wetdrymix != instance_->ramp_wetdrymix;
+}
+
+/* Records the controls a block ended on, for the next block to ramp from */
+static void settle_controls(struct instance *instance_)
+{
+  instance_->ramp_offset = instance_->offset;
+  instance_->ramp_gain = *instance_->ports[PORT_GAIN];
+  instance_->ramp_wetdrymix = *instance_->ports[PORT_WETDRYMIX];
+}
+
+static ALWAYS_INLINE void run_mode(LADSPA_Handle instance, unsigned long sample_count, enum output_mode mode)
 {
   struct instance *const instance_ = (struct instance *) instance;
 
   const LADSPA_Data *const in = instance_->ports[PORT_INPUT];
   LADSPA_Data *const out      = instance_->ports[PORT_OUTPUT];
-  const LADSPA_Data delay     = *instance_->ports[PORT_DELAY];
   const LADSPA_Data feedback  = *instance_->ports[PORT_FEEDBACK];
   const LADSPA_Data gain      = *instance_->ports[PORT_GAIN];
   const LADSPA_Data wetdrymix = *instance_->ports[PORT_WETDRYMIX];
 
-  unsigned long offset = (unsigned long) (delay * (LADSPA_Data) instance_->sample_rate);
-
-  for (unsigned long i = 0; i < sample_count; ++i) {
+  struct delay_line *const line = &instance_->line;
 
-    unsigned long delay_cursor = instance_->cursor + instance_->buffer_size - offset;
-    if (delay_cursor >= instance_->buffer_size)
-      delay_cursor -= instance_->buffer_size;
+  const int ramping = update_controls(instance_);
 
-    LADSPA_Data mix = instance_->buffer[delay_cursor];
-    mix *= gain;
-    mix = wetdrymix * in[i] + (1.f - wetdrymix) * mix;
-    out[i] = mix;
+  /* With nothing but silence in the line and at the input, the output is
+   * silent too and so is everything written back. Whatever is left below
+   * the silence threshold is output as zero. */
+  const int idle = delay_line_is_silent(line) && trailing_silence(in, sample_count) == sample_count;
+  *instance_->ports[PORT_IDLE] = idle ? 1.f : 0.f;
 
-    instance_->buffer[instance_->cursor++] = in[i] + feedback * out[i];
-    if (instance_->cursor == instance_->buffer_size)
-      instance_->cursor = 0;
+  if (idle) {
+    if (mode == OUTPUT_REPLACE)
+      memset(out, 0, sizeof(*out) * sample_count);
+    delay_line_skip(line, sample_count);
+  } else if (ramping) {
+    run_ramped(instance_, in, out, sample_count, gain, feedback, wetdrymix, mode);
+  } else {
+    run_steady(instance_, in, out, sample_count, gain, feedback, wetdrymix, mode);
   }
+
+  settle_controls(instance_);
+}
+
+static void run(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_REPLACE);
+  denormal_guard_leave(guard);
+}
+
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_ADD);
+  denormal_guard_leave(guard);
+}
+
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+  instance_->run_adding_gain = gain;
+}
+
+/* Clears the part of the delay line that has been written, so that the
+ * next activate() has nothing left to clear */
+static void deactivate(LADSPA_Handle instance)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+  delay_line_clear(&instance_->line);
 }
 
 static void cleanup(LADSPA_Handle instance)
 {
   struct instance *const instance_ = (struct instance *) instance;
+  delay_line_release(&instance_->line);
+  arena_free(&instance_->arena);
+}
 
-  free(instance_->buffer);
-  free(instance_);
+static LADSPA_Handle batch_instantiate(const LLP_Batch_Descriptor *descriptor,
+                                       unsigned long sample_rate,
+                                       unsigned long channels)
+{
+  const LADSPA_Data max_delay = descriptor->Descriptor->PortRangeHints[PORT_DELAY].UpperBound;
+  const unsigned long max_offset = (unsigned long) (max_delay * (LADSPA_Data) sample_rate);
+  const size_t frames_size = sizeof(LADSPA_Data) * BATCH_CHUNK_SIZE * channels;
+
+  struct arena arena = {0};
+  const size_t batch_offset = arena_reserve(&arena, sizeof(struct batch));
+  const size_t inputs_offset = arena_reserve(&arena, sizeof(LADSPA_Data *) * channels);
+  const size_t outputs_offset = arena_reserve(&arena, sizeof(LADSPA_Data *) * channels);
+  const size_t in_frames_offset = arena_reserve(&arena, frames_size);
+  const size_t out_frames_offset = arena_reserve(&arena, frames_size);
+  if (arena_allocate(&arena) < 0)
+    return NULL;
+
+  struct batch *const batch_ = arena_at(&arena, batch_offset);
+  batch_->channels = channels;
+  batch_->inputs = arena_at(&arena, inputs_offset);
+  batch_->outputs = arena_at(&arena, outputs_offset);
+  batch_->in_frames = arena_at(&arena, in_frames_offset);
+  batch_->out_frames = arena_at(&arena, out_frames_offset);
+
+  struct instance *const instance_ = &batch_->instance;
+  instance_->arena = arena;
+
+  if (delay_line_reserve(&instance_->line, max_offset + 1, sizeof(LADSPA_Data) * channels) < 0) {
+    arena_free(&instance_->arena);
+    return NULL;
+  }
+  instance_->max_offset = max_offset;
+  instance_->sample_rate = sample_rate;
+  instance_->run_adding_gain = 1.f;
+  instance_->kernel = select_kernel();
+  activate(instance_);
+
+  return (LADSPA_Handle) batch_;
+}
+
+static void batch_connect_port(LADSPA_Handle batch, unsigned long port, unsigned long channel, LADSPA_Data *data_location)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+
+  if (port == PORT_INPUT)
+    batch_->inputs[channel] = data_location;
+  else if (port == PORT_OUTPUT)
+    batch_->outputs[channel] = data_location;
+  else
+    connect_port(&batch_->instance, port, data_location);
+}
+
+static void batch_activate(LADSPA_Handle batch)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+  activate(&batch_->instance);
+}
+
+/* Processes the frames of a chunk, each with every channel in one step.
+ * Ramps, if any, are shared by the channels, and the math is that of
+ * span_scalar() and span_ramped(), so each channel gets what an instance
+ * would. */
+static ALWAYS_INLINE void batch_frames(struct batch *batch_,
+                                       unsigned long count,
+                                       const LADSPA_Data *fades,
+                                       const LADSPA_Data *gains,
+                                       const LADSPA_Data *wetdrymixes,
+                                       int ramping)
+{
+  struct instance *const instance_ = &batch_->instance;
+  struct delay_line *const line = &instance_->line;
+  const unsigned long channels = batch_->channels;
+  const LADSPA_Data feedback = *instance_->ports[PORT_FEEDBACK];
+  const LADSPA_Data gain = *instance_->ports[PORT_GAIN];
+  const LADSPA_Data wetdrymix = *instance_->ports[PORT_WETDRYMIX];
+
+  /* The chunk either reads from before the first frame written or not,
+   * for each tap, see batch_run_frames() */
+  const unsigned long from_offset = instance_->ramp_offset;
+  const unsigned long to_offset = instance_->offset;
+  const int from_silent = delay_line_unwritten(line, from_offset, count) > 0;
+  const int to_silent = delay_line_unwritten(line, to_offset, count) > 0;
+
+  for (unsigned long k = 0; k < count; ++k) {
+    const unsigned long position = line->cursor + k;
+    const LADSPA_Data *const x = &batch_->in_frames[k * channels];
+    LADSPA_Data *const y = &batch_->out_frames[k * channels];
+    const LADSPA_Data *const to = delay_line_frame(line, position - (to_silent ? 0 : to_offset));
+
+    if (ramping) {
+      const LADSPA_Data *const from = delay_line_frame(line, position - (from_silent ? 0 : from_offset));
+      const LADSPA_Data from_scale = from_silent ? 0.f : 1.f;
+      const LADSPA_Data to_scale = to_silent ? 0.f : 1.f;
+
+      for (unsigned long c = 0; c < channels; ++c) {
+        const LADSPA_Data old = from_scale * from[c];
+        LADSPA_Data mix = old + fades[k] * (to_scale * to[c] - old);
+        mix *= gains[k];
+        y[c] = wetdrymixes[k] * x[c] + (1.f - wetdrymixes[k]) * mix;
+      }
+    } else {
+      const LADSPA_Data g = to_silent ? 0.f : gain;
+
+      for (unsigned long c = 0; c < channels; ++c) {
+        LADSPA_Data mix = to[c];
+        mix *= g;
+        y[c] = wetdrymix * x[c] + (1.f - wetdrymix) * mix;
+      }
+    }
+
+    /* Written in a loop of its own, since the taps may be the frame that is
+     * written */
+    LADSPA_Data *const w = delay_line_frame(line, position);
+    for (unsigned long c = 0; c < channels; ++c)
+      w[c] = flush_denormal(x[c] + feedback * y[c]);
+  }
+}
+
+/* Runs a block in chunks that don't wrap around the end of the line. The
+ * inputs of a chunk are transposed into frames, processed, and the frames
+ * of output transposed back. */
+static void batch_run_frames(struct batch *batch_, unsigned long sample_count, int ramping)
+{
+  struct instance *const instance_ = &batch_->instance;
+  struct delay_line *const line = &instance_->line;
+  const unsigned long channels = batch_->channels;
+
+  LADSPA_Data fades[BATCH_CHUNK_SIZE];
+  LADSPA_Data gains[BATCH_CHUNK_SIZE];
+  LADSPA_Data wetdrymixes[BATCH_CHUNK_SIZE];
+
+  unsigned long i = 0;
+  while (i < sample_count) {
+    unsigned long count = sample_count - i;
+    if (count > BATCH_CHUNK_SIZE)
+      count = BATCH_CHUNK_SIZE;
+    if (count > delay_line_contiguous(line, line->cursor))
+      count = delay_line_contiguous(line, line->cursor);
+
+    /* Taps from before the first frame written read as silence, in chunks
+     * of their own */
+    const unsigned long from_unwritten = delay_line_unwritten(line, instance_->ramp_offset, count);
+    const unsigned long to_unwritten = delay_line_unwritten(line, instance_->offset, count);
+    if (ramping && from_unwritten > 0)
+      count = from_unwritten;
+    if (to_unwritten > 0 && count > to_unwritten)
+      count = to_unwritten;
+
+    for (unsigned long c = 0; c < channels; ++c)
+      for (unsigned long k = 0; k < count; ++k)
+        batch_->in_frames[k * channels + c] = batch_->inputs[c][i + k];
+
+    if (ramping) {
+      ramp_linear(fades, count, 0.f, 1.f, i, sample_count);
+      ramp_exponential(gains, count, instance_->ramp_gain, *instance_->ports[PORT_GAIN], i, sample_count);
+      ramp_linear(wetdrymixes, count, instance_->ramp_wetdrymix, *instance_->ports[PORT_WETDRYMIX], i, sample_count);
+      batch_frames(batch_, count, fades, gains, wetdrymixes, 1);
+    } else {
+      batch_frames(batch_, count, NULL, NULL, NULL, 0);
+    }
+
+    /* Only frames that are silent in every channel count */
+    const unsigned long silent = trailing_silence(delay_line_frame(line, line->cursor), count * channels);
+    delay_line_note_silence(line, count, silent / channels);
+    delay_line_advance(line, count);
+
+    for (unsigned long c = 0; c < channels; ++c)
+      for (unsigned long k = 0; k < count; ++k)
+        batch_->outputs[c][i + k] = batch_->out_frames[k * channels + c];
+
+    i += count;
+  }
 }
 
+static void batch_run(LADSPA_Handle batch, unsigned long sample_count)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+  struct instance *const instance_ = &batch_->instance;
+  struct delay_line *const line = &instance_->line;
+
+  const struct denormal_guard guard = denormal_guard_enter();
+
+  const int ramping = update_controls(instance_);
+
+  /* Only idle once every channel is */
+  int idle = delay_line_is_silent(line);
+  for (unsigned long c = 0; idle && c < batch_->channels; ++c)
+    idle = trailing_silence(batch_->inputs[c], sample_count) == sample_count;
+  *instance_->ports[PORT_IDLE] = idle ? 1.f : 0.f;
+
+  if (idle) {
+    for (unsigned long c = 0; c < batch_->channels; ++c)
+      memset(batch_->outputs[c], 0, sizeof(LADSPA_Data) * sample_count);
+    delay_line_skip(line, sample_count);
+  } else {
+    batch_run_frames(batch_, sample_count, ramping);
+  }
+
+  settle_controls(instance_);
+  denormal_guard_leave(guard);
+}
+
+static void batch_deactivate(LADSPA_Handle batch)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+  deactivate(&batch_->instance);
+}
+
+static void batch_cleanup(LADSPA_Handle batch)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+  cleanup(&batch_->instance);
+}
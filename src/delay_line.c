@@ -0,0 +1,84 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "delay_line.h"
+
+unsigned long delay_line_capacity(unsigned long length)
+{
+  unsigned long capacity = 1;
+  while (capacity < length)
+    capacity *= 2;
+  return capacity;
+}
+
+/* Faults in every page of fresh memory. Kernels without
+ * MADV_POPULATE_WRITE get the pages written with the zeros they hold
+ * already. */
+static int populate(void *memory, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(memory, size, MADV_POPULATE_WRITE) == 0)
+    return 0;
+  if (errno != EINVAL)
+    return -1;
+#endif
+
+  memset(memory, 0, size);
+  return 0;
+}
+
+int delay_line_reserve(struct delay_line *line, unsigned long length, size_t frame_size)
+{
+  const unsigned long size = delay_line_capacity(length);
+  const size_t bytes = size * frame_size;
+
+  void *const memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return -1;
+
+  /* Every page is faulted in here, so that run() never takes a page fault
+   * on the line, and running out of memory fails instantiate() instead.
+   * With LLP_MLOCK, locking faults the pages in too. munmap() unlocks
+   * them. */
+  if (!(mlock_requested() && mlock(memory, bytes) == 0) && populate(memory, bytes) < 0) {
+    munmap(memory, bytes);
+    return -1;
+  }
+
+  line->data = memory;
+  line->mask = size - 1;
+  line->cursor = 0;
+  line->written = 0;
+  line->silent = size;
+  line->frame_size = frame_size;
+
+  return 0;
+}
+
+void delay_line_release(struct delay_line *line)
+{
+  munmap(line->data, delay_line_size(line) * line->frame_size);
+}
+
+void delay_line_clear(struct delay_line *line)
+{
+  /* The written frames are the ones just behind the cursor, which may wrap
+   * around the end of the ring */
+  const unsigned long written = delay_line_written(line);
+  const unsigned long first = delay_line_index(line, line->cursor - written);
+  const unsigned long contiguous = delay_line_size(line) - first;
+  const unsigned long first_count = written < contiguous ? written : contiguous;
+
+  memset((char *) line->data + first * line->frame_size, 0, first_count * line->frame_size);
+  memset(line->data, 0, (written - first_count) * line->frame_size);
+
+  line->cursor = 0;
+  line->written = 0;
+  line->silent = delay_line_size(line);
+}
+
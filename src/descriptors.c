@@ -1,15 +1,102 @@
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "descriptors.h"
 
-static const LADSPA_Descriptor *descriptors[] = {
-  &orbit_descriptor,
-  &delay_descriptor,
-  &orbital_delay_descriptor,
-  &granular_descriptor,
-  NULL,
+#define PLUGIN_COUNT 4
+
+/* The descriptors compiled for one instruction set, and the batch versions
+ * of the plugins that have one */
+struct isa {
+  const char                 *name;
+  int                       (*supported)(void);
+  const LADSPA_Descriptor    *descriptors[PLUGIN_COUNT];
+  const LLP_Batch_Descriptor *batch_descriptors[PLUGIN_COUNT];
 };
 
+#define ISA_DESCRIPTORS(isa)                \
+  {                                         \
+    &DESCRIPTOR_PASTE(orbit, isa),          \
+    &DESCRIPTOR_PASTE(delay, isa),          \
+    &DESCRIPTOR_PASTE(orbital_delay, isa),  \
+    &DESCRIPTOR_PASTE(granular, isa),       \
+  },                                        \
+  {                                         \
+    &DESCRIPTOR_PASTE(orbit_batch, isa),    \
+    &DESCRIPTOR_PASTE(delay_batch, isa),    \
+    NULL,                                   \
+    NULL,                                   \
+  }
+
+#if defined(__x86_64__)
+
+extern const LADSPA_Descriptor
+  orbit_descriptor_v2, delay_descriptor_v2, orbital_delay_descriptor_v2, granular_descriptor_v2,
+  orbit_descriptor_v3, delay_descriptor_v3, orbital_delay_descriptor_v3, granular_descriptor_v3,
+  orbit_descriptor_v4, delay_descriptor_v4, orbital_delay_descriptor_v4, granular_descriptor_v4;
+
+extern const LLP_Batch_Descriptor
+  orbit_batch_descriptor_v2, delay_batch_descriptor_v2,
+  orbit_batch_descriptor_v3, delay_batch_descriptor_v3,
+  orbit_batch_descriptor_v4, delay_batch_descriptor_v4;
+
+static int supports_v2(void) { return __builtin_cpu_supports("x86-64-v2"); }
+static int supports_v3(void) { return __builtin_cpu_supports("x86-64-v3"); }
+static int supports_v4(void) { return __builtin_cpu_supports("x86-64-v4"); }
+
+#endif
+
+static int supports_baseline(void) { return 1; }
+
+/* Best first */
+static const struct isa isas[] = {
+#if defined(__x86_64__)
+  {"v4", supports_v4, ISA_DESCRIPTORS(v4)},
+  {"v3", supports_v3, ISA_DESCRIPTORS(v3)},
+  {"v2", supports_v2, ISA_DESCRIPTORS(v2)},
+#endif
+  {
+    "baseline", supports_baseline,
+    {&orbit_descriptor, &delay_descriptor, &orbital_delay_descriptor, &granular_descriptor},
+    {&orbit_batch_descriptor, &delay_batch_descriptor, NULL, NULL},
+  },
+};
+
+#define ISA_COUNT (sizeof(isas) / sizeof(*isas))
+
+static const struct isa *selected = &isas[ISA_COUNT - 1];
+
+/* Picks the descriptors for the best instruction set the CPU supports once,
+ * when the library is loaded. Setting LLP_ISA=v3 (or v2, or baseline) in the
+ * environment starts the search at that one instead. */
+__attribute__((constructor))
+static void select_isa(void)
+{
+  const char *const name = getenv("LLP_ISA");
+  size_t first = 0;
+
+  for (size_t i = 0; name != NULL && i < ISA_COUNT; ++i)
+    if (strcmp(isas[i].name, name) == 0)
+      first = i;
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+#endif
+
+  for (size_t i = first; i < ISA_COUNT; ++i) {
+    if (isas[i].supported()) {
+      selected = &isas[i];
+      return;
+    }
+  }
+}
+
 const LADSPA_Descriptor *ladspa_descriptor(unsigned long index)
 {
-  return descriptors[index];
+  return index < PLUGIN_COUNT ? selected->descriptors[index] : NULL;
+}
+
+const LLP_Batch_Descriptor *llp_batch_descriptor(unsigned long index)
+{
+  return index < PLUGIN_COUNT ? selected->batch_descriptors[index] : NULL;
 }
@@ -4,13 +4,38 @@
  * Description: Tapped delay line granular synthesis
  */
 
-#include <stdlib.h>
-#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #include "ladspa.h"
+#include "arena.h"
+#include "delay_line.h"
+#include "denormal.h"
 #include "descriptors.h"
+#include "rng.h"
 #include "utils.h"
 
+/* Grains are scheduled and rendered this many samples at a time. The delay
+ * line has room for one sub-block on top of the maximum delay, so that a
+ * whole sub-block of input can be written before any grain reads from it. */
+#define SUBBLOCK_SIZE 128
+
+/* Most grains an instance can play at once. The slot arrays are sized
+ * from this bound when the plugin is instantiated. */
+#define MAX_SLOTS 4096
+
+/* Resolution of the shared window tables */
+#define WINDOW_TABLE_SIZE 1024
+
+enum {
+  WINDOW_PARABOLIC = 0,
+  WINDOW_HANN,
+  WINDOW_TUKEY,
+  WINDOW_TRAPEZOID,
+  _WINDOW_COUNT,
+};
+
 enum {
   PORT_INPUT_LEFT = 0,
   PORT_INPUT_RIGHT,
@@ -26,6 +51,11 @@ enum {
   PORT_MAX_GAIN,
   PORT_SLOTS,
   PORT_MASTER_GAIN,
+  PORT_SEED,
+  PORT_WINDOW,
+  PORT_GRAIN_BUDGET,
+  PORT_ACTIVE_GRAINS,
+  PORT_IDLE,
   _PORT_COUNT,
 };
 
@@ -44,6 +74,11 @@ static const LADSPA_PortDescriptor port_descriptors[_PORT_COUNT] = {
   [PORT_MAX_GAIN]             = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
   [PORT_SLOTS]                = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
   [PORT_MASTER_GAIN]          = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
+  [PORT_SEED]                 = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
+  [PORT_WINDOW]               = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
+  [PORT_GRAIN_BUDGET]         = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
+  [PORT_ACTIVE_GRAINS]        = LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL,
+  [PORT_IDLE]                 = LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL,
 };
 
 static const char *const port_names[_PORT_COUNT] = {
@@ -61,6 +96,11 @@ static const char *const port_names[_PORT_COUNT] = {
   [PORT_MAX_GAIN]           = "Max. gain",
   [PORT_SLOTS]              = "Slots",
   [PORT_MASTER_GAIN]        = "Master gain",
+  [PORT_SEED]               = "Seed",
+  [PORT_WINDOW]             = "Window (parabolic/Hann/Tukey/trapezoid)",
+  [PORT_GRAIN_BUDGET]       = "Grain budget",
+  [PORT_ACTIVE_GRAINS]      = "Active grains",
+  [PORT_IDLE]               = "Idle",
 };
 
 static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
@@ -147,7 +187,7 @@ static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
       LADSPA_HINT_INTEGER |
       LADSPA_HINT_DEFAULT_MINIMUM,
     .LowerBound = 1.f,
-    .UpperBound = 64.f,
+    .UpperBound = (LADSPA_Data) MAX_SLOTS,
   },
   [PORT_MASTER_GAIN]  = {
     .HintDescriptor =
@@ -157,38 +197,135 @@ static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
     .LowerBound = .0f,
     .UpperBound = 1.f,
   },
+  [PORT_SEED]         = {
+    .HintDescriptor =
+      LADSPA_HINT_BOUNDED_BELOW |
+      LADSPA_HINT_BOUNDED_ABOVE |
+      LADSPA_HINT_INTEGER |
+      LADSPA_HINT_DEFAULT_0,
+    .LowerBound = 0.f,
+    .UpperBound = 65535.f,
+  },
+  [PORT_WINDOW]       = {
+    .HintDescriptor =
+      LADSPA_HINT_BOUNDED_BELOW |
+      LADSPA_HINT_BOUNDED_ABOVE |
+      LADSPA_HINT_INTEGER |
+      LADSPA_HINT_DEFAULT_0,
+    .LowerBound = 0.f,
+    .UpperBound = (LADSPA_Data) (_WINDOW_COUNT - 1),
+  },
+  [PORT_GRAIN_BUDGET] = {
+    .HintDescriptor =
+      LADSPA_HINT_BOUNDED_BELOW |
+      LADSPA_HINT_BOUNDED_ABOVE |
+      LADSPA_HINT_INTEGER |
+      LADSPA_HINT_DEFAULT_MAXIMUM,
+    .LowerBound = 1.f,
+    .UpperBound = (LADSPA_Data) MAX_SLOTS,
+  },
+  [PORT_ACTIVE_GRAINS] = {
+    .HintDescriptor =
+      LADSPA_HINT_BOUNDED_BELOW |
+      LADSPA_HINT_BOUNDED_ABOVE,
+    .LowerBound = 0.f,
+    .UpperBound = (LADSPA_Data) MAX_SLOTS,
+  },
+  [PORT_IDLE]         = {
+    .HintDescriptor =
+      LADSPA_HINT_TOGGLED,
+  },
+};
+
+/* Slot state, stored as parallel arrays indexed by slot number. Each array
+ * starts on its own cache line of the arena, and lengths, offsets and
+ * times are 32 bits, so that the state of sixteen slots fits in one cache
+ * line per field.
+ *
+ * A slot is either waiting for its next grain to start, in which case it
+ * sits in the wait heap, or playing a grain, in which case it is in the
+ * active list. Times are sample counts that wrap around, and are only ever
+ * compared with times less than 2^31 samples away. */
+struct slots {
+  LADSPA_Data     *pan;
+  LADSPA_Data     *gain;
+  uint32_t        *offset;
+  uint32_t        *length;
+  uint32_t        *start;
+};
+
+/* Whether time a comes before time b */
+static inline int time_before(uint32_t a, uint32_t b)
+{
+  return (int32_t) (a - b) < 0;
+}
+
+/* Ranges that new grains draw their parameters from, in samples */
+struct ranges {
+  unsigned long    min_delay;
+  unsigned long    max_delay;
+  unsigned long    min_length;
+  unsigned long    max_length;
+  unsigned long    min_cooldown;
+  unsigned long    max_cooldown;
+  LADSPA_Data      min_gain;
+  LADSPA_Data      max_gain;
 };
 
-struct slot {
-  LADSPA_Data      pan;
-  LADSPA_Data      gain;
-  unsigned long    length;
-  unsigned long    offset;
-  unsigned long    cursor;
-  unsigned long    cooldown;
+/* Ports the ranges that grains are drawn from are derived from */
+static const unsigned long range_ports[] = {
+  PORT_MIN_DELAY, PORT_MAX_DELAY,
+  PORT_MIN_LENGTH, PORT_MAX_LENGTH,
+  PORT_MIN_COOLDOWN, PORT_MAX_COOLDOWN,
+  PORT_MIN_GAIN, PORT_MAX_GAIN,
 };
 
+_Static_assert(_PORT_COUNT <= CONTROL_CACHE_SIZE, "too many ports for the control cache");
+
 struct instance {
   unsigned long    sample_rate;
-  unsigned long    buffer_size;
   unsigned long    num_slots;
-  unsigned long    cursor;
+  uint32_t         time;
+  LADSPA_Data      run_adding_gain;
+
+  /* A seed of zero picks a seed that is unique to the instance */
+  struct rng       rng;
+  unsigned long    seed;
+  unsigned long    unique_seed;
 
   LADSPA_Data     *ports[_PORT_COUNT];
-  LADSPA_Data     *buffer;
+  struct delay_line line;
+
+  /* Ranges in samples, for the controls they were last computed for */
+  struct control_cache controls;
+  struct ranges    ranges;
+
+  struct slots     slots;
 
-  struct slot     *slots;
+  /* Min-heap of waiting slots, keyed on start time */
+  uint32_t        *waiting;
+  unsigned long    num_waiting;
+
+  /* Slots that are playing a grain, at most as many as the grain budget */
+  uint32_t        *active;
+  unsigned long    num_active;
+
+  struct arena     arena;
 };
 
 static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate);
 static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data *data_location);
+static void activate(LADSPA_Handle instance);
 static void run(LADSPA_Handle instance, unsigned long sample_count);
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count);
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain);
+static void deactivate(LADSPA_Handle instance);
 static void cleanup(LADSPA_Handle instance);
 
-const LADSPA_Descriptor granular_descriptor = {
+const LADSPA_Descriptor DESCRIPTOR(granular) = {
   .UniqueID               = UID_GRANULAR,
   .Label                  = "audio",
-  .Properties             = 0,
+  .Properties             = LADSPA_PROPERTY_HARD_RT_CAPABLE,
   .Name                   = "Granular",
   .Maker                  = MAKER,
   .Copyright              = COPYRIGHT,
@@ -199,41 +336,60 @@ const LADSPA_Descriptor granular_descriptor = {
   .ImplementationData     = NULL,
   .instantiate            = instantiate,
   .connect_port           = connect_port,
-  .activate               = NULL,
+  .activate               = activate,
   .run                    = run,
-  .run_adding             = NULL,
-  .set_run_adding_gain    = NULL,
-  .deactivate             = NULL,
+  .run_adding             = run_adding,
+  .set_run_adding_gain    = set_run_adding_gain,
+  .deactivate             = deactivate,
   .cleanup                = cleanup,
 };
 
+/* Counts instantiations, to give every instance its own default seed */
+static atomic_ulong instance_count;
+
 static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate)
 {
-  struct instance *const instance_ = calloc(1, sizeof(*instance_));
-  if (instance_ == NULL)
-    goto failure;
-
-  instance_->sample_rate = sample_rate;
-
   const LADSPA_Data max_delay = descriptor->PortRangeHints[PORT_MAX_DELAY].UpperBound;
-  instance_->buffer_size = 1 + (unsigned long) (max_delay * (LADSPA_Data) sample_rate);
+  const unsigned long length = 1 + (unsigned long) (max_delay * (LADSPA_Data) sample_rate) + SUBBLOCK_SIZE;
+  const unsigned long max_slots = (unsigned long) descriptor->PortRangeHints[PORT_SLOTS].UpperBound;
+  /* Only used as an operand of sizeof, so that each array is sized by the
+   * element type it is declared with */
+  const struct instance *const layout = NULL;
+
+  struct arena arena = {0};
+  const size_t instance_offset = arena_reserve(&arena, sizeof(*layout));
+  const size_t pan_offset      = arena_reserve(&arena, sizeof(*layout->slots.pan) * max_slots);
+  const size_t gain_offset     = arena_reserve(&arena, sizeof(*layout->slots.gain) * max_slots);
+  const size_t offset_offset   = arena_reserve(&arena, sizeof(*layout->slots.offset) * max_slots);
+  const size_t length_offset   = arena_reserve(&arena, sizeof(*layout->slots.length) * max_slots);
+  const size_t start_offset    = arena_reserve(&arena, sizeof(*layout->slots.start) * max_slots);
+  const size_t waiting_offset  = arena_reserve(&arena, sizeof(*layout->waiting) * max_slots);
+  const size_t active_offset   = arena_reserve(&arena, sizeof(*layout->active) * max_slots);
+  if (arena_allocate(&arena) < 0)
+    return NULL;
+
+  struct instance *const instance_ = arena_at(&arena, instance_offset);
+  instance_->arena = arena;
+
+  if (delay_line_reserve(&instance_->line, length, sizeof(LADSPA_Data)) < 0) {
+    arena_free(&instance_->arena);
+    return NULL;
+  }
 
-  instance_->buffer = calloc(sizeof(*instance_->buffer), instance_->buffer_size);
-  if (instance_->buffer == NULL)
-    goto failure;
+  instance_->slots.pan    = arena_at(&arena, pan_offset);
+  instance_->slots.gain   = arena_at(&arena, gain_offset);
+  instance_->slots.offset = arena_at(&arena, offset_offset);
+  instance_->slots.length = arena_at(&arena, length_offset);
+  instance_->slots.start  = arena_at(&arena, start_offset);
+  instance_->waiting      = arena_at(&arena, waiting_offset);
+  instance_->active       = arena_at(&arena, active_offset);
 
-  const unsigned long max_slots = (unsigned long) descriptor->PortRangeHints[PORT_SLOTS].UpperBound;
-  instance_->slots = calloc(sizeof(*instance_->slots), max_slots);
-  if (instance_->slots == NULL)
-    goto failure;
+  instance_->sample_rate = sample_rate;
+  instance_->run_adding_gain = 1.f;
+  instance_->unique_seed = 65536 + atomic_fetch_add(&instance_count, 1);
+  activate(instance_);
 
   return (LADSPA_Handle) instance_;
-
-failure:
-  free(instance_->slots);
-  free(instance_->buffer);
-  free(instance_);
-  return NULL;
 }
 
 static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data *data_location)
@@ -242,37 +398,297 @@ static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data
   instance_->ports[port] = data_location;
 }
 
-static void run(LADSPA_Handle instance, unsigned long sample_count)
+/* Empties the delay line, clearing only what has been written since it
+ * was last cleared, and drops every grain. The slots are respawned, and
+ * the generator reseeded, by the next run(). */
+static void activate(LADSPA_Handle instance)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+
+  delay_line_clear(&instance_->line);
+  instance_->time = 0;
+  instance_->num_slots = 0;
+  instance_->num_waiting = 0;
+  instance_->num_active = 0;
+  instance_->seed = (unsigned long) -1;
+  control_cache_invalidate(&instance_->controls);
+}
+
+static void heap_sift_down(struct instance *instance_, unsigned long i)
+{
+  uint32_t *const heap = instance_->waiting;
+  const uint32_t *const start = instance_->slots.start;
+
+  for (;;) {
+    const unsigned long left = 2 * i + 1;
+    const unsigned long right = left + 1;
+    unsigned long smallest = i;
+
+    if (left < instance_->num_waiting && time_before(start[heap[left]], start[heap[smallest]]))
+      smallest = left;
+    if (right < instance_->num_waiting && time_before(start[heap[right]], start[heap[smallest]]))
+      smallest = right;
+    if (smallest == i)
+      return;
+
+    const uint32_t tmp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+static void heap_push(struct instance *instance_, uint32_t index)
+{
+  uint32_t *const heap = instance_->waiting;
+  const uint32_t *const start = instance_->slots.start;
+  unsigned long i = instance_->num_waiting++;
+
+  while (i > 0) {
+    const unsigned long parent = (i - 1) / 2;
+    if (!time_before(start[index], start[heap[parent]]))
+      break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+
+  heap[i] = index;
+}
+
+static uint32_t heap_pop(struct instance *instance_)
+{
+  uint32_t *const heap = instance_->waiting;
+  const uint32_t top = heap[0];
+
+  heap[0] = heap[--instance_->num_waiting];
+  heap_sift_down(instance_, 0);
+
+  return top;
+}
+
+/* Drops slots at or above the slot count from the schedule */
+static void drop_slots(struct instance *instance_, unsigned long num_slots)
+{
+  unsigned long n = 0;
+  for (unsigned long i = 0; i < instance_->num_waiting; ++i)
+    if (instance_->waiting[i] < num_slots)
+      instance_->waiting[n++] = instance_->waiting[i];
+  instance_->num_waiting = n;
+
+  for (unsigned long i = n / 2; i-- > 0;)
+    heap_sift_down(instance_, i);
+
+  n = 0;
+  for (unsigned long i = 0; i < instance_->num_active; ++i)
+    if (instance_->active[i] < num_slots)
+      instance_->active[n++] = instance_->active[i];
+  instance_->num_active = n;
+}
+
+/* Gives a slot new random parameters, with its next grain starting after
+ * a cooldown counted from the given time */
+static void respawn(struct instance *instance_, uint32_t index, const struct ranges *ranges, uint32_t time)
+{
+  struct rng *const rng = &instance_->rng;
+  const struct slots *const slots = &instance_->slots;
+
+  slots->offset[index] = ranges->min_delay + rng_range(rng, ranges->max_delay - ranges->min_delay);
+  slots->length[index] = ranges->min_length + rng_range(rng, ranges->max_length - ranges->min_length);
+  slots->gain[index]   = ranges->min_gain + rng_float(rng) * (ranges->max_gain - ranges->min_gain);
+  slots->start[index]  = time + ranges->min_cooldown + rng_range(rng, ranges->max_cooldown - ranges->min_cooldown);
+  slots->pan[index]    = rng_float(rng);
+}
+
+/* Window shapes other than the parabola, sampled over [0, 1] with one
+ * extra point for interpolation. Shared by all instances. */
+static LADSPA_Data window_tables[_WINDOW_COUNT][WINDOW_TABLE_SIZE + 1];
+
+__attribute__((constructor))
+static void init_window_tables(void)
+{
+  for (unsigned long i = 0; i <= WINDOW_TABLE_SIZE; ++i) {
+    const double x = (double) i / WINDOW_TABLE_SIZE;
+
+    window_tables[WINDOW_PARABOLIC][i] = (LADSPA_Data) (4. * x * (1. - x));
+    window_tables[WINDOW_HANN][i] = (LADSPA_Data) (.5 - .5 * cos(2. * PI * x));
+
+    /* Tukey with half of the window tapered, trapezoid with a quarter of
+     * the window ramping at each end */
+    const double edge = x < .5 ? x : 1. - x;
+    window_tables[WINDOW_TUKEY][i] = edge < .25 ?
+                                     (LADSPA_Data) (.5 - .5 * cos(4. * PI * edge)) :
+                                     1.f;
+    window_tables[WINDOW_TRAPEZOID][i] = edge < .25 ? (LADSPA_Data) (4. * edge) : 1.f;
+  }
+}
+
+/* Writes the window for count samples of a grain, starting at the given
+ * position within it */
+static void fill_window(LADSPA_Data *restrict window,
+                        unsigned long shape,
+                        unsigned long position,
+                        unsigned long count,
+                        unsigned long length)
+{
+  /* Count is at most a sub-block, so the loops can use int indices, which
+   * convert to and from float in vector registers */
+  const int n = (int) count;
+  const LADSPA_Data start = (LADSPA_Data) position;
+  const LADSPA_Data step = 1.f / (LADSPA_Data) length;
+
+  /* The parabola has a cheap closed form, so it doesn't need the table */
+  if (shape == WINDOW_PARABOLIC) {
+    for (int k = 0; k < n; ++k) {
+      const LADSPA_Data x = (start + (LADSPA_Data) k) * step;
+      window[k] = 1.f - (2.f * x - 1.f) * (2.f * x - 1.f);
+    }
+    return;
+  }
+
+  const LADSPA_Data *const table = window_tables[shape];
+  const LADSPA_Data scale = step * (LADSPA_Data) WINDOW_TABLE_SIZE;
+
+  for (int k = 0; k < n; ++k) {
+    const LADSPA_Data x = (start + (LADSPA_Data) k) * scale;
+    const int index = (int) x;
+    const LADSPA_Data fraction = x - (LADSPA_Data) index;
+    window[k] = table[index] + fraction * (table[index + 1] - table[index]);
+  }
+}
+
+/* Multiplies a span of taps by the window and pans it into the accumulators */
+static void accumulate(LADSPA_Data *restrict l_accumulator,
+                       LADSPA_Data *restrict r_accumulator,
+                       const LADSPA_Data *restrict taps,
+                       const LADSPA_Data *restrict window,
+                       unsigned long count,
+                       LADSPA_Data l_gain,
+                       LADSPA_Data r_gain)
+{
+  for (unsigned long k = 0; k < count; ++k) {
+    const LADSPA_Data sample = taps[k] * window[k];
+    l_accumulator[k] += l_gain * sample;
+    r_accumulator[k] += r_gain * sample;
+  }
+}
+
+/* Adds the part of a grain that falls within [begin, end) of the current
+ * sub-block, which starts at time t0 and delay line position cursor */
+static void render(const struct instance *instance_,
+                   uint32_t index,
+                   unsigned long shape,
+                   uint32_t t0,
+                   unsigned long cursor,
+                   uint32_t begin,
+                   uint32_t end,
+                   LADSPA_Data *l_accumulator,
+                   LADSPA_Data *r_accumulator)
+{
+  if (!time_before(begin, end))
+    return;
+
+  const struct slots *const slots = &instance_->slots;
+  const unsigned long i = begin - t0;
+  const unsigned long count = end - begin;
+
+  LADSPA_Data window[SUBBLOCK_SIZE];
+  fill_window(window, shape, begin - slots->start[index], count, slots->length[index]);
+
+  const LADSPA_Data l_gain = slots->gain[index] * slots->pan[index];
+  const LADSPA_Data r_gain = slots->gain[index] * (1.f - slots->pan[index]);
+
+  /* Same tap as reading right after writing sample i. The part of the
+   * grain from before the first frame written is silent, and skipped. */
+  const unsigned long position = cursor + i + 1 - slots->offset[index];
+  const unsigned long unwritten = delay_line_unwritten(&instance_->line, instance_->line.cursor - position, count);
+  const struct delay_span taps = delay_line_span(&instance_->line, position + unwritten, count - unwritten);
+  const unsigned long first = unwritten + taps.first_count;
+
+  accumulate(&l_accumulator[i + unwritten], &r_accumulator[i + unwritten], taps.first,
+             &window[unwritten], taps.first_count, l_gain, r_gain);
+  accumulate(&l_accumulator[i + first], &r_accumulator[i + first], taps.second,
+             &window[first], taps.second_count, l_gain, r_gain);
+}
+
+/* Converts the range ports to samples, and clamps them to what they can
+ * be */
+static void update_ranges(struct instance *instance_)
+{
+  struct ranges ranges = {
+    .min_delay    = (unsigned long) (*instance_->ports[PORT_MIN_DELAY] * (LADSPA_Data) instance_->sample_rate),
+    .max_delay    = (unsigned long) (*instance_->ports[PORT_MAX_DELAY] * (LADSPA_Data) instance_->sample_rate),
+    .min_length   = (unsigned long) (*instance_->ports[PORT_MIN_LENGTH] * (LADSPA_Data) instance_->sample_rate),
+    .max_length   = (unsigned long) (*instance_->ports[PORT_MAX_LENGTH] * (LADSPA_Data) instance_->sample_rate),
+    .min_cooldown = (unsigned long) (*instance_->ports[PORT_MIN_COOLDOWN] * (LADSPA_Data) instance_->sample_rate),
+    .max_cooldown = (unsigned long) (*instance_->ports[PORT_MAX_COOLDOWN] * (LADSPA_Data) instance_->sample_rate),
+    .min_gain     = *instance_->ports[PORT_MIN_GAIN],
+    .max_gain     = *instance_->ports[PORT_MAX_GAIN],
+  };
+
+  /* Taps must lie behind the sample being written, and within the part of
+   * the delay line that a sub-block doesn't overwrite */
+  const unsigned long max_offset = delay_line_size(&instance_->line) - SUBBLOCK_SIZE;
+
+  if (ranges.min_delay < 1)
+    ranges.min_delay = 1;
+
+  if (ranges.min_delay > max_offset - 1)
+    ranges.min_delay = max_offset - 1;
+
+  if (ranges.max_delay < ranges.min_delay + 1)
+    ranges.max_delay = ranges.min_delay + 1;
+
+  if (ranges.max_delay > max_offset)
+    ranges.max_delay = max_offset;
+
+  if (ranges.min_length < 1)
+    ranges.min_length = 1;
+
+  if (ranges.max_length < ranges.min_length + 1)
+    ranges.max_length = ranges.min_length + 1;
+
+  if (ranges.max_cooldown < ranges.min_cooldown + 1)
+    ranges.max_cooldown = ranges.min_cooldown + 1;
+
+  if (ranges.max_gain < ranges.min_gain + 0.001f)
+    ranges.max_gain = ranges.min_gain + 0.001f;
+
+  instance_->ranges = ranges;
+}
+
+static ALWAYS_INLINE void run_mode(LADSPA_Handle instance, unsigned long sample_count, enum output_mode mode)
 {
   struct instance *const instance_ = (struct instance *) instance;
 
   /* Read the ports */
   const unsigned long num_slots    = (unsigned long) *instance_->ports[PORT_SLOTS];
+  unsigned long budget             = (unsigned long) *instance_->ports[PORT_GRAIN_BUDGET];
+  const unsigned long seed         = (unsigned long) *instance_->ports[PORT_SEED];
   const LADSPA_Data *const l_in    = instance_->ports[PORT_INPUT_LEFT];
   const LADSPA_Data *const r_in    = instance_->ports[PORT_INPUT_RIGHT];
   LADSPA_Data *const  l_out        = instance_->ports[PORT_OUTPUT_LEFT];
   LADSPA_Data *const  r_out        = instance_->ports[PORT_OUTPUT_RIGHT];
-  const unsigned long min_delay    = (unsigned long) (*instance_->ports[PORT_MIN_DELAY] * (LADSPA_Data) instance_->sample_rate);
-  unsigned long max_delay          = (unsigned long) (*instance_->ports[PORT_MAX_DELAY] * (LADSPA_Data) instance_->sample_rate);
-  const unsigned long min_length   = (unsigned long) (*instance_->ports[PORT_MIN_LENGTH] * (LADSPA_Data) instance_->sample_rate);
-  unsigned long max_length         = (unsigned long) (*instance_->ports[PORT_MAX_LENGTH] * (LADSPA_Data) instance_->sample_rate);
-  const unsigned long min_cooldown = (unsigned long) (*instance_->ports[PORT_MIN_COOLDOWN] * (LADSPA_Data) instance_->sample_rate);
-  unsigned long max_cooldown       = (unsigned long) (*instance_->ports[PORT_MAX_COOLDOWN] * (LADSPA_Data) instance_->sample_rate);
-  const LADSPA_Data min_gain       = *instance_->ports[PORT_MIN_GAIN];
-  LADSPA_Data max_gain             = *instance_->ports[PORT_MAX_GAIN];
   const LADSPA_Data master_gain    = *instance_->ports[PORT_MASTER_GAIN];
+  unsigned long shape              = (unsigned long) *instance_->ports[PORT_WINDOW];
 
-  if (max_delay < min_delay + 1)
-    max_delay = min_delay + 1;
+  if (shape >= _WINDOW_COUNT)
+    shape = WINDOW_PARABOLIC;
 
-  if (max_length < min_length + 1)
-    max_length = min_length + 1;
+  if (budget < 1)
+    budget = 1;
 
-  if (max_cooldown < min_cooldown + 1)
-    max_cooldown = min_cooldown + 1;
+  if (control_cache_update(&instance_->controls, instance_->ports, range_ports,
+                           sizeof(range_ports) / sizeof(*range_ports)))
+    update_ranges(instance_);
 
-  if (max_gain < min_gain + 0.001f)
-    max_gain = min_gain + 0.001f;
+  const struct ranges *const ranges = &instance_->ranges;
+
+  /* Reseed whenever the seed changes, so that offline renders with a
+   * fixed seed are reproducible */
+  if (seed != instance_->seed) {
+    rng_seed(&instance_->rng, seed ? seed : instance_->unique_seed);
+    instance_->seed = seed;
+  }
 
   /* Check if new slots need to be initialized */
   if (num_slots > instance_->num_slots) {
@@ -280,70 +696,149 @@ static void run(LADSPA_Handle instance, unsigned long sample_count)
 
       /* Start in cooldown mode so they don't all start playing
        * at the same time */
-      struct slot *const slot = &instance_->slots[i];
-      slot->offset   = min_delay + rand() % (max_delay - min_delay);
-      slot->length   = min_length + rand() % (max_length - min_length);
-      slot->gain     = min_gain + ((LADSPA_Data) rand() / (LADSPA_Data) RAND_MAX) * (max_gain - min_gain);
-      slot->cooldown = min_cooldown + rand() % (max_cooldown - min_cooldown);
-      slot->pan      = (LADSPA_Data) rand() / (LADSPA_Data) RAND_MAX;
-      slot->cursor   = 0;
+      respawn(instance_, (uint32_t) i, ranges, instance_->time);
+      heap_push(instance_, (uint32_t) i);
     }
+  } else if (num_slots < instance_->num_slots) {
+    drop_slots(instance_, num_slots);
   }
 
-  for (unsigned long i = 0; i < sample_count; ++i) {
-    LADSPA_Data l_accumulator = 0.f;
-    LADSPA_Data r_accumulator = 0.f;
+  instance_->num_slots = num_slots;
 
-    instance_->buffer[instance_->cursor++] = .5f * (l_in[i] + r_in[i]);
-    if (instance_->cursor == instance_->buffer_size)
-      instance_->cursor = 0;
+  /* Cut off the grains that no longer fit in the budget */
+  while (instance_->num_active > budget) {
+    const uint32_t index = instance_->active[--instance_->num_active];
+    respawn(instance_, index, ranges, instance_->time);
+    heap_push(instance_, index);
+  }
 
-    for (unsigned long j = 0; j < num_slots; ++j) {
-      struct slot *const slot = &instance_->slots[j];
+  LADSPA_Data l_accumulator[SUBBLOCK_SIZE];
+  LADSPA_Data r_accumulator[SUBBLOCK_SIZE];
+  unsigned long rendered = 0;
+  unsigned long subblocks = 0;
+  unsigned long idle_subblocks = 0;
+
+  for (unsigned long i = 0; i < sample_count; i += SUBBLOCK_SIZE) {
+    const unsigned long count = sample_count - i < SUBBLOCK_SIZE ? sample_count - i : SUBBLOCK_SIZE;
+    const unsigned long cursor = instance_->line.cursor;
+    const uint32_t t0 = instance_->time;
+    const uint32_t t1 = t0 + (uint32_t) count;
+
+    LADSPA_Data mono[SUBBLOCK_SIZE];
+    for (unsigned long k = 0; k < count; ++k)
+      mono[k] = .5f * (l_in[i + k] + r_in[i + k]);
+
+    /* Once the line holds nothing but silence and more silence is coming,
+     * every grain would be silent. The grains are still scheduled as
+     * usual, so they are where they would have been when sound returns,
+     * but none of them are rendered. */
+    const unsigned long silent = trailing_silence(mono, count);
+    const int idle = delay_line_is_silent(&instance_->line) && silent == count;
+
+    if (idle) {
+      delay_line_skip(&instance_->line, count);
+      ++idle_subblocks;
+    } else {
+      delay_line_write_block(&instance_->line, mono, count);
+      delay_line_note_silence(&instance_->line, count, silent);
+    }
 
-      if (slot->cooldown) {
-        --slot->cooldown;
-        continue;
-      }
+    for (unsigned long k = 0; k < count; ++k) {
+      l_accumulator[k] = 0.f;
+      r_accumulator[k] = 0.f;
+    }
 
-      if (slot->cursor == slot->length) {
-        slot->offset   = min_delay + rand() % (max_delay - min_delay);
-        slot->length   = min_length + rand() % (max_length - min_length);
-        slot->gain     = min_gain + ((LADSPA_Data) rand() / (LADSPA_Data) RAND_MAX) * (max_gain - min_gain);
-        slot->cooldown = min_cooldown + rand() % (max_cooldown - min_cooldown);
-        slot->pan      = (LADSPA_Data) rand() / (LADSPA_Data) RAND_MAX;
-        slot->cursor   = 0;
-        continue;
-      }
+    /* Wake the slots whose grains start in this sub-block. Once the budget
+     * is used up, the remaining slots stay in the heap and their grains
+     * start late, as soon as there is room, so the cost of a sub-block is
+     * bounded by the budget however many slots there are. */
+    while (instance_->num_waiting > 0 && instance_->num_active < budget &&
+           time_before(instance_->slots.start[instance_->waiting[0]], t1)) {
+      const uint32_t index = heap_pop(instance_);
 
-      unsigned long sample_index = instance_->cursor + instance_->buffer_size - slot->offset;
-      if (sample_index >= instance_->buffer_size)
-        sample_index -= instance_->buffer_size;
+      if (time_before(instance_->slots.start[index], t0))
+        instance_->slots.start[index] = t0;
 
-      const LADSPA_Data t = (LADSPA_Data) slot->cursor / (LADSPA_Data) slot->length;
-      const LADSPA_Data env = 1.f - (2.f * t - 1.f) * (2.f * t - 1.f);
+      instance_->active[instance_->num_active++] = index;
+    }
 
-      LADSPA_Data sample = instance_->buffer[sample_index];
-      sample *= env * slot->gain;
-      l_accumulator += slot->pan * sample;
-      r_accumulator += (1.f - slot->pan) * sample;
+    if (!idle)
+      rendered += instance_->num_active;
+    ++subblocks;
+
+    /* Play the active grains. A grain that ends is respawned right away,
+     * and may start over within the same sub-block if its cooldown is
+     * short enough. */
+    for (unsigned long j = instance_->num_active; j-- > 0;) {
+      const uint32_t index = instance_->active[j];
+      const uint32_t *const start = instance_->slots.start;
+
+      for (;;) {
+        const uint32_t begin = time_before(start[index], t0) ? t0 : start[index];
+        const uint32_t end = start[index] + instance_->slots.length[index];
+
+        if (!idle)
+          render(instance_, index, shape, t0, cursor, begin, time_before(end, t1) ? end : t1,
+                 l_accumulator, r_accumulator);
+
+        if (time_before(t1, end))
+          break;
+
+        /* The slot spends the sample at the end of the grain respawning */
+        respawn(instance_, index, ranges, end + 1);
+        if (!time_before(start[index], t1)) {
+          heap_push(instance_, index);
+          instance_->active[j] = instance_->active[--instance_->num_active];
+          break;
+        }
+      }
+    }
 
-      ++slot->cursor;
+    for (unsigned long k = 0; k < count; ++k) {
+      write_output(&l_out[i + k], l_accumulator[k] * master_gain, mode, instance_->run_adding_gain);
+      write_output(&r_out[i + k], r_accumulator[k] * master_gain, mode, instance_->run_adding_gain);
     }
 
-    l_out[i] = l_accumulator * master_gain;
-    r_out[i] = r_accumulator * master_gain;
+    instance_->time = t1;
   }
 
-  instance_->num_slots = num_slots;
+  /* Publish the average number of grains rendered per sub-block, which is
+   * what the cost of the block scales with */
+  *instance_->ports[PORT_ACTIVE_GRAINS] = subblocks ? (LADSPA_Data) rendered / (LADSPA_Data) subblocks : 0.f;
+  *instance_->ports[PORT_IDLE] = idle_subblocks == subblocks ? 1.f : 0.f;
 }
 
-static void cleanup(LADSPA_Handle instance)
+static void run(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_REPLACE);
+  denormal_guard_leave(guard);
+}
+
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_ADD);
+  denormal_guard_leave(guard);
+}
+
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain)
 {
   struct instance *const instance_ = (struct instance *) instance;
+  instance_->run_adding_gain = gain;
+}
 
-  free(instance_->slots);
-  free(instance_->buffer);
-  free(instance_);
+/* Clears the part of the delay line that has been written, so that the
+ * next activate() has nothing left to clear */
+static void deactivate(LADSPA_Handle instance)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+  delay_line_clear(&instance_->line);
 }
 
+static void cleanup(LADSPA_Handle instance)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+  delay_line_release(&instance_->line);
+  arena_free(&instance_->arena);
+}
@@ -5,13 +5,16 @@
  *              around the listeners head.
  */
 
-#include <stdlib.h>
-#include <math.h>
-
 #include "ladspa.h"
+#include "arena.h"
+#include "denormal.h"
 #include "descriptors.h"
+#include "phasor.h"
 #include "utils.h"
 
+/* Number of samples generated per exact evaluation of the orbit angle */
+#define CHUNK_SIZE 64
+
 enum {
   PORT_INPUT = 0,
   PORT_FREQUENCY,
@@ -45,21 +48,47 @@ static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
   [PORT_OUTPUT_RIGHT] = {0},
 };
 
+/* Ports the orbit is derived from */
+static const unsigned long orbit_ports[] = {PORT_FREQUENCY};
+
+_Static_assert(_PORT_COUNT <= CONTROL_CACHE_SIZE, "too many ports for the control cache");
+
 struct instance {
   unsigned long    sample_rate;
   unsigned long    counter;
+
+  /* Orbit, set up for the frequency it was last run with */
+  struct control_cache controls;
+  unsigned long    period;
+  double           step;
+  struct phasor    phasor;
+  LADSPA_Data      run_adding_gain;
   LADSPA_Data     *ports[_PORT_COUNT];
+  struct arena     arena;
+};
+
+/* Channels of Orbit sharing one orbit. The instance holds the orbit and
+ * the control ports; its audio ports are not used. */
+struct batch {
+  struct instance  instance;
+  unsigned long    channels;
+  const LADSPA_Data **inputs;
+  LADSPA_Data    **l_outputs;
+  LADSPA_Data    **r_outputs;
 };
 
 static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate);
 static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data *data_location);
+static void activate(LADSPA_Handle instance);
 static void run(LADSPA_Handle instance, unsigned long sample_count);
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count);
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain);
 static void cleanup(LADSPA_Handle instance);
 
-const LADSPA_Descriptor orbit_descriptor = {
+const LADSPA_Descriptor DESCRIPTOR(orbit) = {
   .UniqueID               = UID_ORBIT,
   .Label                  = "audio",
-  .Properties             = 0,
+  .Properties             = LADSPA_PROPERTY_HARD_RT_CAPABLE,
   .Name                   = "Orbit",
   .Maker                  = MAKER,
   .Copyright              = COPYRIGHT,
@@ -70,24 +99,47 @@ const LADSPA_Descriptor orbit_descriptor = {
   .ImplementationData     = NULL,
   .instantiate            = instantiate,
   .connect_port           = connect_port,
-  .activate               = NULL,
+  .activate               = activate,
   .run                    = run,
-  .run_adding             = NULL,
-  .set_run_adding_gain    = NULL,
+  .run_adding             = run_adding,
+  .set_run_adding_gain    = set_run_adding_gain,
   .deactivate             = NULL,
   .cleanup                = cleanup,
 };
 
+static LADSPA_Handle batch_instantiate(const LLP_Batch_Descriptor *descriptor,
+                                       unsigned long sample_rate,
+                                       unsigned long channels);
+static void batch_connect_port(LADSPA_Handle batch, unsigned long port, unsigned long channel, LADSPA_Data *data_location);
+static void batch_activate(LADSPA_Handle batch);
+static void batch_run(LADSPA_Handle batch, unsigned long sample_count);
+static void batch_cleanup(LADSPA_Handle batch);
+
+const LLP_Batch_Descriptor BATCH_DESCRIPTOR(orbit) = {
+  .Descriptor             = &DESCRIPTOR(orbit),
+  .instantiate            = batch_instantiate,
+  .connect_port           = batch_connect_port,
+  .activate               = batch_activate,
+  .deactivate             = NULL,
+  .run                    = batch_run,
+  .cleanup                = batch_cleanup,
+};
+
 static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate)
 {
   (void) descriptor;
 
-  struct instance *const instance_ = calloc(1, sizeof(*instance_));
-  if (instance_ == NULL)
+  struct arena arena = {0};
+  const size_t instance_offset = arena_reserve(&arena, sizeof(struct instance));
+  if (arena_allocate(&arena) < 0)
     return NULL;
 
+  struct instance *const instance_ = arena_at(&arena, instance_offset);
+  instance_->arena = arena;
+
   instance_->sample_rate = sample_rate;
-  instance_->counter = 0;
+  instance_->run_adding_gain = 1.f;
+  activate(instance_);
 
   return (LADSPA_Handle ) instance_;
 }
@@ -98,36 +150,181 @@ static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data
   instance_->ports[port] = data_location;
 }
 
-static void run(LADSPA_Handle instance, unsigned long sample_count)
+/* Starts the orbit over from angle zero */
+static void activate(LADSPA_Handle instance)
 {
   struct instance *const instance_ = (struct instance *) instance;
 
-  for (unsigned long i = 0; i < sample_count; ++i) {
+  instance_->counter = 0;
+  control_cache_invalidate(&instance_->controls);
+}
 
-    /* Frequency measured in samples */
-    const LADSPA_Data frequency =
-      (unsigned long) (*instance_->ports[PORT_FREQUENCY] *
-                       (LADSPA_Data) instance_->sample_rate);
+/* Runs any number of channels through the same orbit. The orbit only
+ * depends on the controls, so each chunk of it is computed once and then
+ * applied to every channel. */
+static ALWAYS_INLINE void run_channels(struct instance *instance_,
+                                       const LADSPA_Data *const *in,
+                                       LADSPA_Data *const *l_out,
+                                       LADSPA_Data *const *r_out,
+                                       unsigned long channels,
+                                       unsigned long sample_count,
+                                       enum output_mode mode)
+{
+  const LADSPA_Data radius      = *instance_->ports[PORT_RADIUS];
+  const LADSPA_Data adding_gain = instance_->run_adding_gain;
 
-    if (instance_->counter++ >= (unsigned long) frequency)
-      instance_->counter = 0;
+  /* Frequency measured in samples. The counter runs from 0 to period
+   * inclusive, and the angle goes from 0 to 2 pi over the period */
+  if (control_cache_update(&instance_->controls, instance_->ports, orbit_ports,
+                           sizeof(orbit_ports) / sizeof(*orbit_ports))) {
+    instance_->period = (unsigned long) (*instance_->ports[PORT_FREQUENCY] *
+                                         (LADSPA_Data) instance_->sample_rate);
+    instance_->step = instance_->period ? 2. * PI / (double) instance_->period : 0.;
+    phasor_init(&instance_->phasor, instance_->step);
+  }
+
+  const unsigned long period = instance_->period;
+  const double step = instance_->step;
+
+  LADSPA_Data cosines[CHUNK_SIZE];
+  LADSPA_Data sines[CHUNK_SIZE];
+  LADSPA_Data l_distances[CHUNK_SIZE];
+  LADSPA_Data r_distances[CHUNK_SIZE];
+
+  unsigned long i = 0;
+  while (i < sample_count) {
+
+    /* Chunks never cross the point where the counter wraps */
+    unsigned long counter = instance_->counter >= period ? 0 : instance_->counter + 1;
+
+    unsigned long count = sample_count - i;
+    if (count > CHUNK_SIZE)
+      count = CHUNK_SIZE;
+    if (count > period - counter + 1)
+      count = period - counter + 1;
+
+    phasor_fill(&instance_->phasor, cosines, sines, count, step * (double) counter);
+
+    /* Squared distances to the left and right ear */
+    for (unsigned long k = 0; k < count; ++k) {
+      const LADSPA_Data dx_l = radius * cosines[k] - 1.f;
+      const LADSPA_Data dx_r = radius * cosines[k] + 1.f;
+      const LADSPA_Data dy   = radius * sines[k];
+      l_distances[k] = dx_l * dx_l + dy * dy;
+      r_distances[k] = dx_r * dx_r + dy * dy;
+    }
 
-    const LADSPA_Data angle  = (LADSPA_Data) instance_->counter / frequency * 2.f * PI;
-    const LADSPA_Data radius = *instance_->ports[PORT_RADIUS];
-    const LADSPA_Data dx_l   = radius * cos(angle) - 1.f;
-    const LADSPA_Data dx_r   = radius * cos(angle) + 1.f;
-    const LADSPA_Data dy     = radius * sin(angle);
-    const LADSPA_Data dl2    = dx_l * dx_l + dy * dy;
-    const LADSPA_Data dr2    = dx_r * dx_r + dy * dy;
+    for (unsigned long c = 0; c < channels; ++c) {
+      for (unsigned long k = 0; k < count; ++k) {
+        const LADSPA_Data sample = in[c][i + k];
+        write_output(&l_out[c][i + k], sample / l_distances[k], mode, adding_gain);
+        write_output(&r_out[c][i + k], sample / r_distances[k], mode, adding_gain);
+      }
+    }
 
-    const LADSPA_Data sample = instance_->ports[PORT_INPUT][i];
-    instance_->ports[PORT_OUTPUT_LEFT][i] = sample / dl2;
-    instance_->ports[PORT_OUTPUT_RIGHT][i] = sample / dr2;
+    instance_->counter = counter + count - 1;
+    i += count;
   }
 }
 
+static ALWAYS_INLINE void run_mode(LADSPA_Handle instance, unsigned long sample_count, enum output_mode mode)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+
+  const LADSPA_Data *const in = instance_->ports[PORT_INPUT];
+  LADSPA_Data *const l_out    = instance_->ports[PORT_OUTPUT_LEFT];
+  LADSPA_Data *const r_out    = instance_->ports[PORT_OUTPUT_RIGHT];
+
+  run_channels(instance_, &in, &l_out, &r_out, 1, sample_count, mode);
+}
+
+static void run(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_REPLACE);
+  denormal_guard_leave(guard);
+}
+
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_ADD);
+  denormal_guard_leave(guard);
+}
+
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+  instance_->run_adding_gain = gain;
+}
+
 static void cleanup(LADSPA_Handle instance)
 {
-  free(instance);
+  struct instance *const instance_ = (struct instance *) instance;
+  arena_free(&instance_->arena);
 }
 
+static LADSPA_Handle batch_instantiate(const LLP_Batch_Descriptor *descriptor,
+                                       unsigned long sample_rate,
+                                       unsigned long channels)
+{
+  (void) descriptor;
+
+  struct arena arena = {0};
+  const size_t batch_offset = arena_reserve(&arena, sizeof(struct batch));
+  const size_t inputs_offset = arena_reserve(&arena, sizeof(LADSPA_Data *) * channels);
+  const size_t l_outputs_offset = arena_reserve(&arena, sizeof(LADSPA_Data *) * channels);
+  const size_t r_outputs_offset = arena_reserve(&arena, sizeof(LADSPA_Data *) * channels);
+  if (arena_allocate(&arena) < 0)
+    return NULL;
+
+  struct batch *const batch_ = arena_at(&arena, batch_offset);
+  batch_->channels = channels;
+  batch_->inputs = arena_at(&arena, inputs_offset);
+  batch_->l_outputs = arena_at(&arena, l_outputs_offset);
+  batch_->r_outputs = arena_at(&arena, r_outputs_offset);
+
+  struct instance *const instance_ = &batch_->instance;
+  instance_->arena = arena;
+  instance_->sample_rate = sample_rate;
+  instance_->run_adding_gain = 1.f;
+  activate(instance_);
+
+  return (LADSPA_Handle) batch_;
+}
+
+static void batch_connect_port(LADSPA_Handle batch, unsigned long port, unsigned long channel, LADSPA_Data *data_location)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+
+  if (port == PORT_INPUT)
+    batch_->inputs[channel] = data_location;
+  else if (port == PORT_OUTPUT_LEFT)
+    batch_->l_outputs[channel] = data_location;
+  else if (port == PORT_OUTPUT_RIGHT)
+    batch_->r_outputs[channel] = data_location;
+  else
+    connect_port(&batch_->instance, port, data_location);
+}
+
+static void batch_activate(LADSPA_Handle batch)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+  activate(&batch_->instance);
+}
+
+static void batch_run(LADSPA_Handle batch, unsigned long sample_count)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_channels(&batch_->instance, batch_->inputs, batch_->l_outputs, batch_->r_outputs,
+               batch_->channels, sample_count, OUTPUT_REPLACE);
+  denormal_guard_leave(guard);
+}
+
+static void batch_cleanup(LADSPA_Handle batch)
+{
+  struct batch *const batch_ = (struct batch *) batch;
+  cleanup(&batch_->instance);
+}
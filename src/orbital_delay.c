@@ -4,14 +4,21 @@
  * Description: Delay effect with some cool panning
  */
 
-#include <stdlib.h>
 #include <string.h>
-#include <math.h>
 
 #include "ladspa.h"
+#include "arena.h"
+#include "delay_line.h"
+#include "denormal.h"
 #include "descriptors.h"
+#include "one_pole.h"
+#include "phasor.h"
+#include "ramp.h"
 #include "utils.h"
 
+/* Most samples filtered as one block in the feedback path */
+#define CHUNK_SIZE 64
+
 enum {
   PORT_INPUT_LEFT = 0,
   PORT_OUTPUT_LEFT,
@@ -28,6 +35,7 @@ enum {
   PORT_WETDRYMIX_RIGHT,
   PORT_CUTOFF_RIGHT,
   PORT_ORBITAL,
+  PORT_IDLE,
   _PORT_COUNT,
 };
 
@@ -47,6 +55,7 @@ static const LADSPA_PortDescriptor port_descriptors[_PORT_COUNT] = {
   [PORT_WETDRYMIX_RIGHT]    = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
   [PORT_CUTOFF_RIGHT]       = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
   [PORT_ORBITAL]            = LADSPA_PORT_INPUT  | LADSPA_PORT_CONTROL,
+  [PORT_IDLE]               = LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL,
 };
 
 static const char *const port_names[_PORT_COUNT] = {
@@ -65,6 +74,7 @@ static const char *const port_names[_PORT_COUNT] = {
   [PORT_WETDRYMIX_RIGHT]    = "Right wet/dry mix",
   [PORT_CUTOFF_RIGHT]       = "Right cutoff",
   [PORT_ORBITAL]            = "Orbital",
+  [PORT_IDLE]               = "Idle",
 };
 
 static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
@@ -83,27 +93,59 @@ static const LADSPA_PortRangeHint port_range_hints[_PORT_COUNT] = {
   [PORT_WETDRYMIX_RIGHT] = PORT_RANGE_HINTS_BOUNDED_FLOAT(0.f, 1.f, 0),
   [PORT_CUTOFF_RIGHT]    = PORT_RANGE_HINTS_BOUNDED_FLOAT(0.f, 1.f, 0),
   [PORT_ORBITAL]         = PORT_RANGE_HINTS_BOUNDED_FLOAT(0.f, 10.f, 0),
+  [PORT_IDLE]            = {.HintDescriptor = LADSPA_HINT_TOGGLED},
 };
 
+/* Ports the pan, the tap offsets and the filters are derived from */
+static const unsigned long pan_ports[] = {PORT_ORBITAL};
+static const unsigned long offset_ports[] = {PORT_DELAY_LEFT, PORT_DELAY_RIGHT};
+static const unsigned long filter_ports[] = {PORT_CUTOFF_LEFT, PORT_CUTOFF_RIGHT};
+
+_Static_assert(_PORT_COUNT <= CONTROL_CACHE_SIZE, "too many ports for the control cache");
+
 struct instance {
   unsigned long    sample_rate;
   LADSPA_Data     *ports[_PORT_COUNT];
-  LADSPA_Data     *left_buffer;
-  LADSPA_Data     *right_buffer;
-  unsigned long    buffer_size;
-  unsigned long    cursor;
+  struct delay_line line;
+  unsigned long    max_offset;
   unsigned long    counter;
+
+  /* Pan oscillator and tap offsets, for the controls they were last run
+   * with */
+  struct control_cache controls;
+  unsigned long    l_offset;
+  unsigned long    r_offset;
+  unsigned long    period;
+  double           step;
+  struct phasor    phasor;
+
+  /* Values the last block ended on, which the next block ramps from. Not
+   * valid until the first block after activate(). */
+  int              ramps_valid;
+  unsigned long    ramp_l_offset;
+  unsigned long    ramp_r_offset;
+  stereo_frame     ramp_gain;
+  stereo_frame     ramp_wetdrymix;
+
+  LADSPA_Data      run_adding_gain;
+  struct one_pole  l_filter;
+  struct one_pole  r_filter;
+  struct arena     arena;
 };
 
 static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate);
 static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data *data_location);
+static void activate(LADSPA_Handle instance);
 static void run(LADSPA_Handle instance, unsigned long sample_count);
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count);
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain);
+static void deactivate(LADSPA_Handle instance);
 static void cleanup(LADSPA_Handle instance);
 
-const LADSPA_Descriptor orbital_delay_descriptor = {
+const LADSPA_Descriptor DESCRIPTOR(orbital_delay) = {
   .UniqueID               = UID_ORBITAL_DELAY,
   .Label                  = "audio",
-  .Properties             = 0,
+  .Properties             = LADSPA_PROPERTY_HARD_RT_CAPABLE,
   .Name                   = "Orbital delay",
   .Maker                  = MAKER,
   .Copyright              = COPYRIGHT,
@@ -114,42 +156,35 @@ const LADSPA_Descriptor orbital_delay_descriptor = {
   .ImplementationData     = NULL,
   .instantiate            = instantiate,
   .connect_port           = connect_port,
-  .activate               = NULL,
+  .activate               = activate,
   .run                    = run,
-  .run_adding             = NULL,
-  .set_run_adding_gain    = NULL,
-  .deactivate             = NULL,
+  .run_adding             = run_adding,
+  .set_run_adding_gain    = set_run_adding_gain,
+  .deactivate             = deactivate,
   .cleanup                = cleanup,
 };
 
 static LADSPA_Handle instantiate(const struct _LADSPA_Descriptor *descriptor, unsigned long sample_rate)
 {
-  struct instance *const instance_ = calloc(1, sizeof(*instance_));
-  if (instance_ == NULL)
-    return NULL;
-
   const LADSPA_Data max_delay = descriptor->PortRangeHints[PORT_DELAY_LEFT].UpperBound;
-  instance_->buffer_size = 1 + (unsigned long) (max_delay * (LADSPA_Data) sample_rate);
+  const unsigned long max_offset = (unsigned long) (max_delay * (LADSPA_Data) sample_rate);
 
-  instance_->left_buffer = malloc(sizeof(*instance_->left_buffer) * instance_->buffer_size);
-  if (instance_->left_buffer == NULL) {
-    free(instance_);
+  struct arena arena = {0};
+  const size_t instance_offset = arena_reserve(&arena, sizeof(struct instance));
+  if (arena_allocate(&arena) < 0)
     return NULL;
-  }
 
-  instance_->right_buffer = malloc(sizeof(*instance_->right_buffer) * instance_->buffer_size);
-  if (instance_->right_buffer == NULL) {
-    free(instance_->left_buffer);
-    free(instance_);
+  struct instance *const instance_ = arena_at(&arena, instance_offset);
+  instance_->arena = arena;
+
+  if (delay_line_reserve(&instance_->line, max_offset + 1, sizeof(stereo_frame)) < 0) {
+    arena_free(&instance_->arena);
     return NULL;
   }
-
-  memset(instance_->left_buffer, 0, sizeof(*instance_->left_buffer) * instance_->buffer_size);
-  memset(instance_->right_buffer, 0, sizeof(*instance_->right_buffer) * instance_->buffer_size);
-
+  instance_->max_offset = max_offset;
   instance_->sample_rate = sample_rate;
-  instance_->cursor = 0;
-  instance_->counter = 0;
+  instance_->run_adding_gain = 1.f;
+  activate(instance_);
 
   return (LADSPA_Handle) instance_;
 }
@@ -160,7 +195,46 @@ static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data
   instance_->ports[port] = data_location;
 }
 
-static void run(LADSPA_Handle instance, unsigned long sample_count)
+/* Empties the delay line, clearing only what has been written since it
+ * was last cleared, and starts the pan and the feedback filters over */
+static void activate(LADSPA_Handle instance)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+
+  delay_line_clear(&instance_->line);
+  instance_->counter = 0;
+  control_cache_invalidate(&instance_->controls);
+  instance_->ramps_valid = 0;
+  one_pole_init(&instance_->l_filter);
+  one_pole_init(&instance_->r_filter);
+}
+
+/* Writes the pan for the next count samples, from -1 to 1 and back */
+static void fill_pans(struct instance *instance_, LADSPA_Data *pans, unsigned long count)
+{
+  LADSPA_Data cosines[CHUNK_SIZE];
+  const unsigned long period = instance_->period;
+
+  /* Pieces never cross the point where the counter wraps */
+  unsigned long k = 0;
+  while (k < count) {
+    const unsigned long counter = instance_->counter;
+
+    unsigned long n = count - k;
+    if (n > period - counter + 1)
+      n = period - counter + 1;
+
+    phasor_fill(&instance_->phasor, cosines, &pans[k], n, instance_->step * (double) counter);
+
+    for (unsigned long j = k; j < k + n; ++j)
+      pans[j] = -1.f + 2.f * pans[j];
+
+    instance_->counter = counter + n > period ? 0 : counter + n;
+    k += n;
+  }
+}
+
+static ALWAYS_INLINE void run_mode(LADSPA_Handle instance, unsigned long sample_count, enum output_mode mode)
 {
   struct instance *const instance_ = (struct instance *) instance;
 
@@ -168,80 +242,252 @@ static void run(LADSPA_Handle instance, unsigned long sample_count)
   const LADSPA_Data *r_in       = instance_->ports[PORT_INPUT_RIGHT];
   LADSPA_Data *l_out            = instance_->ports[PORT_OUTPUT_LEFT];
   LADSPA_Data *r_out            = instance_->ports[PORT_OUTPUT_RIGHT];
-  const LADSPA_Data l_delay     = *instance_->ports[PORT_DELAY_LEFT];
-  const LADSPA_Data r_delay     = *instance_->ports[PORT_DELAY_RIGHT];
   const LADSPA_Data l_feedback  = *instance_->ports[PORT_FEEDBACK_LEFT];
   const LADSPA_Data r_feedback  = *instance_->ports[PORT_FEEDBACK_RIGHT];
   const LADSPA_Data l_gain      = *instance_->ports[PORT_GAIN_LEFT];
   const LADSPA_Data r_gain      = *instance_->ports[PORT_GAIN_RIGHT];
   const LADSPA_Data l_wetdrymix = *instance_->ports[PORT_WETDRYMIX_LEFT];
   const LADSPA_Data r_wetdrymix = *instance_->ports[PORT_WETDRYMIX_RIGHT];
-  const LADSPA_Data l_cutoff    = *instance_->ports[PORT_CUTOFF_LEFT];
-  const LADSPA_Data r_cutoff    = *instance_->ports[PORT_CUTOFF_RIGHT];
-
-  const LADSPA_Data orbital     = *instance_->ports[PORT_ORBITAL] *
-                                  (LADSPA_Data) instance_->sample_rate;
-
-  unsigned long l_offset = (unsigned long) (l_delay * (LADSPA_Data) instance_->sample_rate);
-  unsigned long r_offset = (unsigned long) (r_delay * (LADSPA_Data) instance_->sample_rate);
-
-  for (unsigned long i = 0; i < sample_count; ++i) {
 
-    unsigned long l_delay_cursor = instance_->cursor + instance_->buffer_size - l_offset;
-    if (l_delay_cursor >= instance_->buffer_size)
-      l_delay_cursor -= instance_->buffer_size;
+  /* Orbital time measured in samples. The counter runs from 0 to period
+   * inclusive, and the pan angle advances by 2 pi per orbital time. An
+   * orbital time of zero holds the pan still. */
+  if (control_cache_update(&instance_->controls, instance_->ports, pan_ports,
+                           sizeof(pan_ports) / sizeof(*pan_ports))) {
+    const LADSPA_Data samples = *instance_->ports[PORT_ORBITAL] * (LADSPA_Data) instance_->sample_rate;
 
-    unsigned long r_delay_cursor = instance_->cursor + instance_->buffer_size - r_offset;
-    if (r_delay_cursor >= instance_->buffer_size)
-      r_delay_cursor -= instance_->buffer_size;
+    instance_->period = (unsigned long) samples;
+    instance_->step = samples > 0.f ? 2. * PI / (double) samples : 0.;
+    phasor_init(&instance_->phasor, instance_->step);
 
-    LADSPA_Data l_mix = instance_->left_buffer[l_delay_cursor];
-    l_mix *= l_gain;
-    l_mix = l_wetdrymix * l_in[i] + (1.f - l_wetdrymix) * l_mix;
-    l_out[i] = l_mix;
+    if (instance_->counter > instance_->period)
+      instance_->counter = 0;
+  }
 
-    LADSPA_Data r_mix = instance_->right_buffer[r_delay_cursor];
-    r_mix *= r_gain;
-    r_mix = r_wetdrymix * r_in[i] + (1.f - r_wetdrymix) * r_mix;
-    r_out[i] = r_mix;
+  struct delay_line *const line = &instance_->line;
+
+  /* A delay of zero is the longest one, max_offset + 1 frames, as far back
+   * as the line has to reach. Any other delay is at most max_offset. */
+  if (control_cache_update(&instance_->controls, instance_->ports, offset_ports,
+                           sizeof(offset_ports) / sizeof(*offset_ports))) {
+    unsigned long l_offset = (unsigned long) (*instance_->ports[PORT_DELAY_LEFT] * (LADSPA_Data) instance_->sample_rate);
+    unsigned long r_offset = (unsigned long) (*instance_->ports[PORT_DELAY_RIGHT] * (LADSPA_Data) instance_->sample_rate);
+
+    if (l_offset > instance_->max_offset)
+      l_offset = instance_->max_offset;
+    if (l_offset == 0)
+      l_offset = instance_->max_offset + 1;
+    if (r_offset > instance_->max_offset)
+      r_offset = instance_->max_offset;
+    if (r_offset == 0)
+      r_offset = instance_->max_offset + 1;
+
+    instance_->l_offset = l_offset;
+    instance_->r_offset = r_offset;
+  }
 
-    LADSPA_Data pan = -1.f + 2.f * sin(2.f * PI * (LADSPA_Data) instance_->counter / orbital);
+  const unsigned long l_offset = instance_->l_offset;
+  const unsigned long r_offset = instance_->r_offset;
 
-    if (instance_->counter++ >= (unsigned long) orbital)
-      instance_->counter = 0;
+  if (control_cache_update(&instance_->controls, instance_->ports, filter_ports,
+                           sizeof(filter_ports) / sizeof(*filter_ports))) {
+    one_pole_set(&instance_->l_filter, *instance_->ports[PORT_CUTOFF_LEFT]);
+    one_pole_set(&instance_->r_filter, *instance_->ports[PORT_CUTOFF_RIGHT]);
+  }
 
-    // LADSPA_Data l_writeback = pan * l_out[i] + (1.f - pan) * r_out[i];
-    // LADSPA_Data r_writeback = pan * r_out[i] + (1.f - pan) * l_out[i];
+  /* Left in lane 0, right in lane 1 */
+  const stereo_frame port_gain = {l_gain, r_gain};
+  const stereo_frame feedback  = {l_feedback, r_feedback};
+  const stereo_frame wetdrymix = {l_wetdrymix, r_wetdrymix};
+
+  if (!instance_->ramps_valid) {
+    instance_->ramps_valid = 1;
+    instance_->ramp_l_offset = l_offset;
+    instance_->ramp_r_offset = r_offset;
+    instance_->ramp_gain = port_gain;
+    instance_->ramp_wetdrymix = wetdrymix;
+  }
 
-    LADSPA_Data l_writeback = l_in[i] + l_feedback * l_out[i];
-    LADSPA_Data r_writeback = r_in[i] + r_feedback * r_out[i];
+  /* Controls that changed since the last block move over this one instead
+   * of stepping at its start: gains and wet/dry mixes follow ramps, and a
+   * delay crossfades from a head at the old delay to one at the new delay */
+  const unsigned long l_from = instance_->ramp_l_offset;
+  const unsigned long r_from = instance_->ramp_r_offset;
+  const stereo_frame from_gain = instance_->ramp_gain;
+  const stereo_frame from_wetdrymix = instance_->ramp_wetdrymix;
+  const int ramping = l_from != l_offset || r_from != r_offset ||
+                      from_gain[0] != l_gain || from_gain[1] != r_gain ||
+                      from_wetdrymix[0] != l_wetdrymix || from_wetdrymix[1] != r_wetdrymix;
+
+  instance_->ramp_l_offset = l_offset;
+  instance_->ramp_r_offset = r_offset;
+  instance_->ramp_gain = port_gain;
+  instance_->ramp_wetdrymix = wetdrymix;
+
+  /* With nothing but silence in the line and at the inputs, the outputs
+   * are silent too and so is everything written back. The filters are
+   * silent as well, since their state is the last frame written. Whatever
+   * is left below the silence threshold is output as zero, and only the
+   * pan needs to move on. */
+  const int idle = delay_line_is_silent(line) &&
+                   trailing_silence(l_in, sample_count) == sample_count &&
+                   trailing_silence(r_in, sample_count) == sample_count;
+  *instance_->ports[PORT_IDLE] = idle ? 1.f : 0.f;
+
+  if (idle) {
+    if (mode == OUTPUT_REPLACE) {
+      memset(l_out, 0, sizeof(*l_out) * sample_count);
+      memset(r_out, 0, sizeof(*r_out) * sample_count);
+    }
+    instance_->counter = (instance_->counter + sample_count) % (instance_->period + 1);
+    delay_line_skip(line, sample_count);
+    return;
+  }
 
-    l_writeback = pan * l_writeback + (1.f - pan) * r_writeback;
-    r_writeback = pan * r_writeback + (1.f - pan) * l_writeback;
+  /* Split the block into chunks no longer than the delays, so that the
+   * taps of a chunk never read what the chunk writes. Each chunk computes
+   * its writebacks first, then runs them through the cutoff filters as a
+   * block and writes them to the line. */
+  LADSPA_Data l_writeback[CHUNK_SIZE];
+  LADSPA_Data r_writeback[CHUNK_SIZE];
+  LADSPA_Data pans[CHUNK_SIZE];
+  LADSPA_Data fades[CHUNK_SIZE];
+  LADSPA_Data l_gains[CHUNK_SIZE];
+  LADSPA_Data r_gains[CHUNK_SIZE];
+  LADSPA_Data l_wetdrymixes[CHUNK_SIZE];
+  LADSPA_Data r_wetdrymixes[CHUNK_SIZE];
+
+  unsigned long i = 0;
+  while (i < sample_count) {
+    unsigned long count = sample_count - i;
+    if (count > CHUNK_SIZE)
+      count = CHUNK_SIZE;
+
+    /* A tap from before the first frame written reads as silence, in
+     * chunks of its own that read the frame being written instead, with
+     * no gain */
+    const unsigned long l_unwritten = delay_line_unwritten(line, l_offset, count);
+    const unsigned long r_unwritten = delay_line_unwritten(line, r_offset, count);
+    const unsigned long l_from_unwritten = delay_line_unwritten(line, l_from, count);
+    const unsigned long r_from_unwritten = delay_line_unwritten(line, r_from, count);
+    const unsigned long l_tap = l_unwritten ? 0 : l_offset;
+    const unsigned long r_tap = r_unwritten ? 0 : r_offset;
+    const stereo_frame gain = {
+      l_unwritten ? 0.f : port_gain[0],
+      r_unwritten ? 0.f : port_gain[1],
+    };
+    const unsigned long l_from_tap = l_from_unwritten ? 0 : l_from;
+    const unsigned long r_from_tap = r_from_unwritten ? 0 : r_from;
+    const stereo_frame from_scale = {l_from_unwritten ? 0.f : 1.f, r_from_unwritten ? 0.f : 1.f};
+    const stereo_frame to_scale = {l_unwritten ? 0.f : 1.f, r_unwritten ? 0.f : 1.f};
+
+    if (l_unwritten > 0 && count > l_unwritten)
+      count = l_unwritten;
+    if (r_unwritten > 0 && count > r_unwritten)
+      count = r_unwritten;
+    if (ramping && l_from_unwritten > 0 && count > l_from_unwritten)
+      count = l_from_unwritten;
+    if (ramping && r_from_unwritten > 0 && count > r_from_unwritten)
+      count = r_from_unwritten;
+    if (l_tap > 0 && count > l_tap)
+      count = l_tap;
+    if (r_tap > 0 && count > r_tap)
+      count = r_tap;
+    if (ramping && l_from_tap > 0 && count > l_from_tap)
+      count = l_from_tap;
+    if (ramping && r_from_tap > 0 && count > r_from_tap)
+      count = r_from_tap;
+
+    fill_pans(instance_, pans, count);
+
+    if (ramping) {
+      ramp_linear(fades, count, 0.f, 1.f, i, sample_count);
+      ramp_exponential(l_gains, count, from_gain[0], l_gain, i, sample_count);
+      ramp_exponential(r_gains, count, from_gain[1], r_gain, i, sample_count);
+      ramp_linear(l_wetdrymixes, count, from_wetdrymix[0], l_wetdrymix, i, sample_count);
+      ramp_linear(r_wetdrymixes, count, from_wetdrymix[1], r_wetdrymix, i, sample_count);
+    }
+
+    for (unsigned long k = 0; k < count; ++k) {
+      const stereo_frame in = {l_in[i + k], r_in[i + k]};
+      const LADSPA_Data pan = pans[k];
+
+      stereo_frame mix;
+      stereo_frame wet = wetdrymix;
+      if (ramping) {
+        const stereo_frame old = from_scale * stereo_delay_line_tap(line, line->cursor + k, l_from_tap, r_from_tap);
+        const stereo_frame new = to_scale * stereo_delay_line_tap(line, line->cursor + k, l_tap, r_tap);
+        mix = old + fades[k] * (new - old);
+        mix *= (stereo_frame) {l_gains[k], r_gains[k]};
+        wet = (stereo_frame) {l_wetdrymixes[k], r_wetdrymixes[k]};
+      } else {
+        mix = stereo_delay_line_tap(line, line->cursor + k, l_tap, r_tap);
+        mix *= gain;
+      }
+      mix = wet * in + (1.f - wet) * mix;
+
+      /* Pan each channel's writeback against the other. The left channel
+       * is panned first, and the right channel is panned against the
+       * result, which takes a second pass with the panned left in lane 1. */
+      const stereo_frame writeback = in + feedback * mix;
+      const stereo_frame swapped = __builtin_shuffle(writeback, (stereo_mask) {1, 0});
+      const stereo_frame panned_left = pan * writeback + (1.f - pan) * swapped;
+      const stereo_frame other = __builtin_shuffle(writeback, panned_left, (stereo_mask) {1, 2});
+      const stereo_frame panned = pan * writeback + (1.f - pan) * other;
+
+      l_writeback[k] = panned[0];
+      r_writeback[k] = panned[1];
+
+      write_output(&l_out[i + k], mix[0], mode, instance_->run_adding_gain);
+      write_output(&r_out[i + k], mix[1], mode, instance_->run_adding_gain);
+    }
+
+    one_pole_process(&instance_->l_filter, l_writeback, count);
+    one_pole_process(&instance_->r_filter, r_writeback, count);
+
+    for (unsigned long k = 0; k < count; ++k)
+      stereo_delay_line_write(line, (stereo_frame) {l_writeback[k], r_writeback[k]});
+
+    const unsigned long l_silent = trailing_silence(l_writeback, count);
+    const unsigned long r_silent = trailing_silence(r_writeback, count);
+    delay_line_note_silence(line, count, l_silent < r_silent ? l_silent : r_silent);
+
+    i += count;
+  }
+}
 
-    unsigned long cutoff_cursor = instance_->cursor > 0 ?
-                                  instance_->cursor - 1 :
-                                  instance_->buffer_size - 1;
+static void run(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_REPLACE);
+  denormal_guard_leave(guard);
+}
 
-    instance_->left_buffer[instance_->cursor] =
-      (l_cutoff) * l_writeback +
-      (1.f - l_cutoff) * instance_->left_buffer[cutoff_cursor];
+static void run_adding(LADSPA_Handle instance, unsigned long sample_count)
+{
+  const struct denormal_guard guard = denormal_guard_enter();
+  run_mode(instance, sample_count, OUTPUT_ADD);
+  denormal_guard_leave(guard);
+}
 
-    instance_->right_buffer[instance_->cursor] =
-      (r_cutoff) * r_writeback +
-      (1.f - r_cutoff) * instance_->left_buffer[cutoff_cursor];
+static void set_run_adding_gain(LADSPA_Handle instance, LADSPA_Data gain)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+  instance_->run_adding_gain = gain;
+}
 
-    if (instance_->cursor++ == instance_->buffer_size)
-      instance_->cursor = 0;
-  }
+/* Clears the part of the delay line that has been written, so that the
+ * next activate() has nothing left to clear */
+static void deactivate(LADSPA_Handle instance)
+{
+  struct instance *const instance_ = (struct instance *) instance;
+  delay_line_clear(&instance_->line);
 }
 
 static void cleanup(LADSPA_Handle instance)
 {
   struct instance *const instance_ = (struct instance *) instance;
-
-  free(instance_->left_buffer);
-  free(instance_->right_buffer);
-  free(instance_);
+  delay_line_release(&instance_->line);
+  arena_free(&instance_->arena);
 }
 
@@ -0,0 +1,917 @@
+/*
+ * Offline benchmark host
+ *
+ * Loads the plugin library, instantiates every descriptor at a range of
+ * sample rates and block sizes, sweeps the control ports across their
+ * range hints and reports the cost of run() for each configuration.
+ * Plugins with an output control port that isn't a toggle, such as
+ * Granular's active grain count, also get the cost per sample divided by
+ * that port's average.
+ * The tail mode instead feeds each plugin a burst of noise followed by
+ * silence and reports the cost of each second of the silent tail, which
+ * should stay flat as feedback paths decay towards zero. The batch mode
+ * compares a number of instances of a plugin with one batch of as many
+ * channels.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "ladspa.h"
+
+#define DEFAULT_LIBRARY "build/libllp.so"
+#define MAX_BLOCK_SIZE 8192
+#define NUM_SWEEP_POINTS 3
+
+#define CHECK_SAMPLE_RATE 48000
+#define CHECK_BLOCK_SIZE 997
+#define CHECK_POINTS 5
+#define CHECK_CHANNELS 5
+
+#define MAX_PINS 16
+
+#define TAIL_SAMPLE_RATE 48000
+#define TAIL_BLOCK_SIZE 256
+
+static const unsigned long default_sample_rates[] = {
+  44100, 48000, 96000, 192000,
+};
+
+/* A control port held at a fixed value instead of being swept */
+struct pin {
+  const char      *name;
+  LADSPA_Data      value;
+};
+
+struct options {
+  const char      *library;
+  const char      *plugin;
+  unsigned long    sample_rate;
+  unsigned long    block_size;
+  double           seconds;
+  unsigned long    tail;
+  unsigned long    channels;
+  int              check;
+  struct pin       pins[MAX_PINS];
+  unsigned long    num_pins;
+};
+
+struct result {
+  double           ns_per_sample;
+  double           rtf;
+  double           p50;
+  double           p99;
+  double           max;
+  double           output;
+};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  const double x = *(const double *) a;
+  const double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Deterministic white noise, so that runs are comparable */
+static void fill_noise(LADSPA_Data *data, unsigned long count, unsigned long *state)
+{
+  for (unsigned long i = 0; i < count; ++i) {
+    *state = *state * 1103515245ul + 12345ul;
+    data[i] = (LADSPA_Data) ((*state >> 16) & 0x7fff) / 16384.f - 1.f;
+  }
+}
+
+/* Maps a sweep position in [0, 1] onto the range described by the hint */
+static LADSPA_Data control_value(const LADSPA_PortRangeHint *hint, unsigned long sample_rate, double position)
+{
+  const LADSPA_PortRangeHintDescriptor hd = hint->HintDescriptor;
+
+  if (LADSPA_IS_HINT_TOGGLED(hd))
+    return position < .5 ? 0.f : 1.f;
+
+  double lower = LADSPA_IS_HINT_BOUNDED_BELOW(hd) ? hint->LowerBound : 0.;
+  double upper = LADSPA_IS_HINT_BOUNDED_ABOVE(hd) ? hint->UpperBound : 1.;
+
+  if (LADSPA_IS_HINT_SAMPLE_RATE(hd)) {
+    lower *= (double) sample_rate;
+    upper *= (double) sample_rate;
+  }
+
+  double value;
+  if (LADSPA_IS_HINT_LOGARITHMIC(hd) && lower > 0.)
+    value = exp(log(lower) + position * (log(upper) - log(lower)));
+  else
+    value = lower + position * (upper - lower);
+
+  if (LADSPA_IS_HINT_INTEGER(hd))
+    value = round(value);
+
+  return (LADSPA_Data) value;
+}
+
+/* Sets every input control port to a sweep position, except for the ones
+ * that are pinned */
+static void set_controls(const LADSPA_Descriptor *descriptor,
+                         const struct options *options,
+                         LADSPA_Data *controls,
+                         unsigned long sample_rate,
+                         double position)
+{
+  for (unsigned long p = 0; p < descriptor->PortCount; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (!LADSPA_IS_PORT_CONTROL(pd) || !LADSPA_IS_PORT_INPUT(pd))
+      continue;
+
+    controls[p] = control_value(&descriptor->PortRangeHints[p], sample_rate, position);
+    for (unsigned long i = 0; i < options->num_pins; ++i)
+      if (strcasecmp(options->pins[i].name, descriptor->PortNames[p]) == 0)
+        controls[p] = options->pins[i].value;
+  }
+}
+
+/* Index of the first output control port that counts something, or
+ * port_count if there is none. Toggles such as "Idle" are skipped, since
+ * cost per unit of them means nothing. */
+static unsigned long output_control(const LADSPA_Descriptor *descriptor)
+{
+  unsigned long p = 0;
+  for (; p < descriptor->PortCount; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (LADSPA_IS_PORT_CONTROL(pd) && LADSPA_IS_PORT_OUTPUT(pd) &&
+        !LADSPA_IS_HINT_TOGGLED(descriptor->PortRangeHints[p].HintDescriptor))
+      break;
+  }
+  return p;
+}
+
+static int run_config(const LADSPA_Descriptor *descriptor,
+                      const struct options *options,
+                      unsigned long sample_rate,
+                      unsigned long block_size,
+                      struct result *result)
+{
+  const unsigned long port_count = descriptor->PortCount;
+  const unsigned long output = output_control(descriptor);
+  const double seconds = options->seconds;
+  LADSPA_Data *audio = NULL;
+  LADSPA_Data *controls = NULL;
+  double *latencies = NULL;
+  LADSPA_Handle handle = NULL;
+  int status = -1;
+
+  const unsigned long points_blocks = 1 + (unsigned long) (seconds * (double) sample_rate /
+                                                           (double) NUM_SWEEP_POINTS /
+                                                           (double) block_size);
+  const unsigned long num_blocks = points_blocks * NUM_SWEEP_POINTS;
+
+  audio = malloc(sizeof(*audio) * port_count * block_size);
+  controls = calloc(port_count, sizeof(*controls));
+  latencies = malloc(sizeof(*latencies) * num_blocks);
+  if (audio == NULL || controls == NULL || latencies == NULL)
+    goto done;
+
+  handle = descriptor->instantiate(descriptor, sample_rate);
+  if (handle == NULL)
+    goto done;
+
+  unsigned long noise = 1;
+  for (unsigned long p = 0; p < port_count; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (LADSPA_IS_PORT_AUDIO(pd)) {
+      fill_noise(&audio[p * block_size], block_size, &noise);
+      descriptor->connect_port(handle, p, &audio[p * block_size]);
+    } else {
+      descriptor->connect_port(handle, p, &controls[p]);
+    }
+  }
+
+  if (descriptor->activate)
+    descriptor->activate(handle);
+
+  unsigned long n = 0;
+  double total = 0.;
+  double output_total = 0.;
+
+  for (unsigned long point = 0; point < NUM_SWEEP_POINTS; ++point) {
+    const double position = (double) point / (double) (NUM_SWEEP_POINTS - 1);
+    set_controls(descriptor, options, controls, sample_rate, position);
+
+    for (unsigned long b = 0; b < points_blocks; ++b) {
+      const double start = now_ns();
+      descriptor->run(handle, block_size);
+      const double elapsed = now_ns() - start;
+
+      latencies[n++] = elapsed;
+      total += elapsed;
+      if (output < port_count)
+        output_total += controls[output];
+    }
+  }
+
+  if (descriptor->deactivate)
+    descriptor->deactivate(handle);
+
+  qsort(latencies, num_blocks, sizeof(*latencies), compare_doubles);
+
+  const double samples = (double) num_blocks * (double) block_size;
+  result->ns_per_sample = total / samples;
+  result->rtf = total / (samples / (double) sample_rate * 1e9);
+  result->p50 = latencies[num_blocks / 2] / 1e3;
+  result->p99 = latencies[num_blocks * 99 / 100] / 1e3;
+  result->max = latencies[num_blocks - 1] / 1e3;
+  result->output = output_total / (double) num_blocks;
+  status = 0;
+
+done:
+  if (handle)
+    descriptor->cleanup(handle);
+  free(latencies);
+  free(controls);
+  free(audio);
+  return status;
+}
+
+/* Runs a second of noise and then options->tail seconds of silence through
+ * the plugin, with the controls in the middle of their ranges, and prints
+ * the cost of the noise and of each second of silence */
+static int run_tail(const LADSPA_Descriptor *descriptor, const struct options *options)
+{
+  const unsigned long port_count = descriptor->PortCount;
+  const unsigned long sample_rate = options->sample_rate ? options->sample_rate : TAIL_SAMPLE_RATE;
+  const unsigned long block_size = options->block_size ? options->block_size : TAIL_BLOCK_SIZE;
+  const unsigned long blocks_per_second = (sample_rate + block_size - 1) / block_size;
+  LADSPA_Data *audio = NULL;
+  LADSPA_Data *controls = NULL;
+  LADSPA_Handle handle = NULL;
+  int status = -1;
+
+  audio = malloc(sizeof(*audio) * port_count * block_size);
+  controls = calloc(port_count, sizeof(*controls));
+  if (audio == NULL || controls == NULL)
+    goto done;
+
+  handle = descriptor->instantiate(descriptor, sample_rate);
+  if (handle == NULL)
+    goto done;
+
+  for (unsigned long p = 0; p < port_count; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (LADSPA_IS_PORT_AUDIO(pd))
+      descriptor->connect_port(handle, p, &audio[p * block_size]);
+    else
+      descriptor->connect_port(handle, p, &controls[p]);
+  }
+
+  set_controls(descriptor, options, controls, sample_rate, .5);
+
+  if (descriptor->activate)
+    descriptor->activate(handle);
+
+  printf("%s (UID %lu), %lu Hz, block %lu\n", descriptor->Name, descriptor->UniqueID, sample_rate, block_size);
+  printf("  %7s %10s\n", "second", "ns/sample");
+
+  unsigned long noise = 1;
+  for (unsigned long second = 0; second <= options->tail; ++second) {
+    double total = 0.;
+
+    for (unsigned long b = 0; b < blocks_per_second; ++b) {
+
+      /* The output buffers are rewritten every block, so only the inputs
+       * need refilling: with noise for the first second, then silence */
+      for (unsigned long p = 0; p < port_count; ++p) {
+        const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+        if (!LADSPA_IS_PORT_AUDIO(pd) || !LADSPA_IS_PORT_INPUT(pd))
+          continue;
+        if (second == 0)
+          fill_noise(&audio[p * block_size], block_size, &noise);
+        else
+          memset(&audio[p * block_size], 0, sizeof(*audio) * block_size);
+      }
+
+      const double start = now_ns();
+      descriptor->run(handle, block_size);
+      total += now_ns() - start;
+    }
+
+    const double ns_per_sample = total / (double) (blocks_per_second * block_size);
+    if (second == 0)
+      printf("  %7s %10.2f\n", "noise", ns_per_sample);
+    else
+      printf("  %7lu %10.2f\n", second, ns_per_sample);
+    fflush(stdout);
+  }
+
+  if (descriptor->deactivate)
+    descriptor->deactivate(handle);
+
+  printf("\n");
+  status = 0;
+
+done:
+  if (handle)
+    descriptor->cleanup(handle);
+  free(controls);
+  free(audio);
+  return status;
+}
+
+/* FNV-1a over the raw bytes of a buffer */
+static unsigned long long hash_data(unsigned long long hash, const LADSPA_Data *data, unsigned long count)
+{
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (unsigned long i = 0; i < count * sizeof(*data); ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+/* Renders a fixed workload and hashes the output, so that different builds
+ * and kernels of the same plugin can be checked for identical output.
+ * With adding set, the workload is rendered through run_adding() with a
+ * gain of one half into silent buffers, and the output is scaled back up
+ * before hashing, which must give the same hash as run(). With in_place
+ * set, each audio output shares its buffer with an audio input, pairing
+ * them in port order, which must not change the hash either. The seed
+ * picks the noise fed to the inputs. */
+static int check_descriptor(const LADSPA_Descriptor *descriptor,
+                            int adding,
+                            int in_place,
+                            unsigned long seed,
+                            unsigned long long *hash)
+{
+  const unsigned long port_count = descriptor->PortCount;
+  const unsigned long block_size = CHECK_BLOCK_SIZE;
+  const unsigned long sample_rate = CHECK_SAMPLE_RATE;
+  LADSPA_Data *audio = NULL;
+  LADSPA_Data **buffers = NULL;
+  LADSPA_Data *controls = NULL;
+  LADSPA_Handle handle = NULL;
+  int status = -1;
+
+  /* Plugins may draw from the C library's generator, so give each pass
+   * the same sequence */
+  srand(1);
+
+  audio = malloc(sizeof(*audio) * port_count * block_size);
+  buffers = malloc(sizeof(*buffers) * port_count);
+  controls = calloc(port_count, sizeof(*controls));
+  if (audio == NULL || buffers == NULL || controls == NULL)
+    goto done;
+
+  unsigned long next_input = 0;
+  for (unsigned long p = 0; p < port_count; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    buffers[p] = &audio[p * block_size];
+
+    if (!in_place || !LADSPA_IS_PORT_AUDIO(pd) || !LADSPA_IS_PORT_OUTPUT(pd))
+      continue;
+
+    while (next_input < port_count &&
+           !(LADSPA_IS_PORT_AUDIO(descriptor->PortDescriptors[next_input]) &&
+             LADSPA_IS_PORT_INPUT(descriptor->PortDescriptors[next_input])))
+      ++next_input;
+    if (next_input < port_count)
+      buffers[p] = &audio[next_input++ * block_size];
+  }
+
+  handle = descriptor->instantiate(descriptor, sample_rate);
+  if (handle == NULL)
+    goto done;
+
+  for (unsigned long p = 0; p < port_count; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (LADSPA_IS_PORT_AUDIO(pd))
+      descriptor->connect_port(handle, p, buffers[p]);
+    else
+      descriptor->connect_port(handle, p, &controls[p]);
+  }
+
+  if (adding)
+    descriptor->set_run_adding_gain(handle, .5f);
+
+  if (descriptor->activate)
+    descriptor->activate(handle);
+
+  unsigned long noise = seed;
+  *hash = 0xcbf29ce484222325ull;
+
+  /* Stay clear of the bounds, where a zero seed port would make a plugin
+   * pick a seed of its own */
+  for (unsigned long point = 0; point < CHECK_POINTS; ++point) {
+    const double position = (double) (point + 1) / (double) (CHECK_POINTS + 1);
+
+    for (unsigned long p = 0; p < port_count; ++p) {
+      const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+      if (LADSPA_IS_PORT_CONTROL(pd) && LADSPA_IS_PORT_INPUT(pd))
+        controls[p] = control_value(&descriptor->PortRangeHints[p], sample_rate, position);
+    }
+
+    for (unsigned long n = 0; n < sample_rate; n += block_size) {
+      /* Outputs are cleared first so that outputs sharing a buffer with
+       * an input get the input */
+      for (unsigned long p = 0; p < port_count; ++p) {
+        const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+        if (LADSPA_IS_PORT_AUDIO(pd) && LADSPA_IS_PORT_OUTPUT(pd))
+          memset(buffers[p], 0, sizeof(*audio) * block_size);
+      }
+      for (unsigned long p = 0; p < port_count; ++p) {
+        const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+        if (LADSPA_IS_PORT_AUDIO(pd) && LADSPA_IS_PORT_INPUT(pd))
+          fill_noise(buffers[p], block_size, &noise);
+      }
+
+      if (adding)
+        descriptor->run_adding(handle, block_size);
+      else
+        descriptor->run(handle, block_size);
+
+      for (unsigned long p = 0; p < port_count; ++p) {
+        const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+        if (!LADSPA_IS_PORT_AUDIO(pd) || !LADSPA_IS_PORT_OUTPUT(pd))
+          continue;
+
+        /* Adding to a silent buffer turns negative zeros positive, so
+         * normalize those in both passes */
+        LADSPA_Data *const out = buffers[p];
+        for (unsigned long i = 0; i < block_size; ++i)
+          out[i] = (adding ? 2.f * out[i] : out[i]) + 0.f;
+
+        *hash = hash_data(*hash, out, block_size);
+      }
+    }
+  }
+
+  if (descriptor->deactivate)
+    descriptor->deactivate(handle);
+
+  status = 0;
+
+done:
+  if (handle)
+    descriptor->cleanup(handle);
+  free(controls);
+  free(buffers);
+  free(audio);
+  return status;
+}
+
+/* Renders the workload of check_descriptor() through a batch of
+ * CHECK_CHANNELS channels, feeding channel c the noise of seed c + 1, and
+ * hashes the output of each channel separately. Each hash must match that
+ * of a single instance given the same seed. */
+static int check_batch(const LLP_Batch_Descriptor *batch, unsigned long long *hashes)
+{
+  const LADSPA_Descriptor *descriptor = batch->Descriptor;
+  const unsigned long port_count = descriptor->PortCount;
+  const unsigned long block_size = CHECK_BLOCK_SIZE;
+  const unsigned long sample_rate = CHECK_SAMPLE_RATE;
+  const unsigned long channels = CHECK_CHANNELS;
+  unsigned long noise[CHECK_CHANNELS];
+  LADSPA_Data *audio = NULL;
+  LADSPA_Data *controls = NULL;
+  LADSPA_Handle handle = NULL;
+  int status = -1;
+
+  srand(1);
+
+  audio = malloc(sizeof(*audio) * port_count * channels * block_size);
+  controls = calloc(port_count, sizeof(*controls));
+  if (audio == NULL || controls == NULL)
+    goto done;
+
+  handle = batch->instantiate(batch, sample_rate, channels);
+  if (handle == NULL)
+    goto done;
+
+  for (unsigned long p = 0; p < port_count; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (!LADSPA_IS_PORT_AUDIO(pd)) {
+      batch->connect_port(handle, p, 0, &controls[p]);
+      continue;
+    }
+    for (unsigned long c = 0; c < channels; ++c)
+      batch->connect_port(handle, p, c, &audio[(p * channels + c) * block_size]);
+  }
+
+  if (batch->activate)
+    batch->activate(handle);
+
+  for (unsigned long c = 0; c < channels; ++c) {
+    noise[c] = c + 1;
+    hashes[c] = 0xcbf29ce484222325ull;
+  }
+
+  for (unsigned long point = 0; point < CHECK_POINTS; ++point) {
+    const double position = (double) (point + 1) / (double) (CHECK_POINTS + 1);
+
+    for (unsigned long p = 0; p < port_count; ++p) {
+      const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+      if (LADSPA_IS_PORT_CONTROL(pd) && LADSPA_IS_PORT_INPUT(pd))
+        controls[p] = control_value(&descriptor->PortRangeHints[p], sample_rate, position);
+    }
+
+    for (unsigned long n = 0; n < sample_rate; n += block_size) {
+      for (unsigned long c = 0; c < channels; ++c) {
+        for (unsigned long p = 0; p < port_count; ++p) {
+          const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+          if (LADSPA_IS_PORT_AUDIO(pd) && LADSPA_IS_PORT_INPUT(pd))
+            fill_noise(&audio[(p * channels + c) * block_size], block_size, &noise[c]);
+        }
+      }
+
+      batch->run(handle, block_size);
+
+      for (unsigned long c = 0; c < channels; ++c) {
+        for (unsigned long p = 0; p < port_count; ++p) {
+          const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+          if (!LADSPA_IS_PORT_AUDIO(pd) || !LADSPA_IS_PORT_OUTPUT(pd))
+            continue;
+
+          LADSPA_Data *const out = &audio[(p * channels + c) * block_size];
+          for (unsigned long i = 0; i < block_size; ++i)
+            out[i] += 0.f;
+
+          hashes[c] = hash_data(hashes[c], out, block_size);
+        }
+      }
+    }
+  }
+
+  if (batch->deactivate)
+    batch->deactivate(handle);
+
+  status = 0;
+
+done:
+  if (handle)
+    batch->cleanup(handle);
+  free(controls);
+  free(audio);
+  return status;
+}
+
+static int check(const LADSPA_Descriptor *descriptor, const LLP_Batch_Descriptor *batch)
+{
+  unsigned long long hash, adding_hash, in_place_hash;
+
+  if (check_descriptor(descriptor, 0, 0, 1, &hash) < 0)
+    return -1;
+
+  printf("%-16s %016llx", descriptor->Name, hash);
+
+  if (descriptor->run_adding && descriptor->set_run_adding_gain) {
+    if (check_descriptor(descriptor, 1, 0, 1, &adding_hash) < 0)
+      return -1;
+    if (adding_hash != hash) {
+      printf("  run_adding mismatch (%016llx)\n", adding_hash);
+      return -1;
+    }
+  }
+
+  /* Unless a plugin says in-place processing is broken, a host may pass
+   * the same buffer for an input and an output */
+  if (!LADSPA_IS_INPLACE_BROKEN(descriptor->Properties)) {
+    if (check_descriptor(descriptor, 0, 1, 1, &in_place_hash) < 0)
+      return -1;
+    if (in_place_hash != hash) {
+      printf("  in-place mismatch (%016llx)\n", in_place_hash);
+      return -1;
+    }
+  }
+
+  /* Every channel of a batch must match an instance fed the same input */
+  if (batch) {
+    unsigned long long batch_hashes[CHECK_CHANNELS];
+    if (check_batch(batch, batch_hashes) < 0)
+      return -1;
+    for (unsigned long c = 0; c < CHECK_CHANNELS; ++c) {
+      unsigned long long channel_hash;
+      if (check_descriptor(descriptor, 0, 0, c + 1, &channel_hash) < 0)
+        return -1;
+      if (batch_hashes[c] != channel_hash) {
+        printf("  batch mismatch on channel %lu (%016llx)\n", c, batch_hashes[c]);
+        return -1;
+      }
+    }
+  }
+
+  printf("\n");
+  return 0;
+}
+
+static void bench_descriptor(const LADSPA_Descriptor *descriptor, const struct options *options)
+{
+  const unsigned long output = output_control(descriptor);
+  const int has_output = output < descriptor->PortCount;
+
+  printf("%s (UID %lu)\n", descriptor->Name, descriptor->UniqueID);
+  if (has_output)
+    printf("  output: %s\n", descriptor->PortNames[output]);
+  printf("  %7s %6s %10s %10s %10s %10s %10s",
+         "rate", "block", "ns/sample", "RTF", "p50 us", "p99 us", "max us");
+  if (has_output)
+    printf(" %10s %10s", "output", "ns/output");
+  printf("\n");
+
+  const unsigned long num_rates = sizeof(default_sample_rates) / sizeof(*default_sample_rates);
+
+  for (unsigned long r = 0; r < num_rates; ++r) {
+    const unsigned long sample_rate = default_sample_rates[r];
+    if (options->sample_rate && options->sample_rate != sample_rate)
+      continue;
+
+    for (unsigned long block_size = 1; block_size <= MAX_BLOCK_SIZE; block_size *= 2) {
+      if (options->block_size && options->block_size != block_size)
+        continue;
+
+      struct result result;
+      if (run_config(descriptor, options, sample_rate, block_size, &result) < 0) {
+        printf("  %7lu %6lu   failed to instantiate\n", sample_rate, block_size);
+        continue;
+      }
+
+      printf("  %7lu %6lu %10.2f %10.5f %10.2f %10.2f %10.2f",
+             sample_rate, block_size, result.ns_per_sample, result.rtf,
+             result.p50, result.p99, result.max);
+      if (has_output)
+        printf(" %10.2f %10.3f", result.output,
+               result.output > 0. ? result.ns_per_sample / result.output : 0.);
+      printf("\n");
+      fflush(stdout);
+    }
+  }
+
+  printf("\n");
+}
+
+/* Times options->channels channels of the plugin for options->seconds,
+ * sweeping the controls, either as one batch or as an instance per
+ * channel, and returns the cost per sample of each channel */
+static int run_channels(const LLP_Batch_Descriptor *batch,
+                        const struct options *options,
+                        unsigned long sample_rate,
+                        unsigned long block_size,
+                        int batched,
+                        double *ns_per_sample)
+{
+  const LADSPA_Descriptor *descriptor = batch->Descriptor;
+  const unsigned long port_count = descriptor->PortCount;
+  const unsigned long channels = options->channels;
+  const unsigned long handle_count = batched ? 1 : channels;
+  LADSPA_Data *audio = NULL;
+  LADSPA_Data *controls = NULL;
+  LADSPA_Handle *handles = NULL;
+  int status = -1;
+
+  const unsigned long points_blocks = 1 + (unsigned long) (options->seconds * (double) sample_rate /
+                                                           (double) NUM_SWEEP_POINTS /
+                                                           (double) block_size);
+
+  audio = malloc(sizeof(*audio) * port_count * channels * block_size);
+  controls = calloc(port_count, sizeof(*controls));
+  handles = calloc(handle_count, sizeof(*handles));
+  if (audio == NULL || controls == NULL || handles == NULL)
+    goto done;
+
+  for (unsigned long h = 0; h < handle_count; ++h) {
+    handles[h] = batched ?
+                 batch->instantiate(batch, sample_rate, channels) :
+                 descriptor->instantiate(descriptor, sample_rate);
+    if (handles[h] == NULL)
+      goto done;
+  }
+
+  unsigned long noise = 1;
+  for (unsigned long p = 0; p < port_count; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    for (unsigned long c = 0; c < channels; ++c) {
+      LADSPA_Data *const data = LADSPA_IS_PORT_AUDIO(pd) ? &audio[(p * channels + c) * block_size] : &controls[p];
+      if (LADSPA_IS_PORT_AUDIO(pd))
+        fill_noise(data, block_size, &noise);
+      if (batched)
+        batch->connect_port(handles[0], p, c, data);
+      else
+        descriptor->connect_port(handles[c], p, data);
+    }
+  }
+
+  for (unsigned long h = 0; h < handle_count; ++h) {
+    if (batched && batch->activate)
+      batch->activate(handles[h]);
+    else if (!batched && descriptor->activate)
+      descriptor->activate(handles[h]);
+  }
+
+  double total = 0.;
+
+  for (unsigned long point = 0; point < NUM_SWEEP_POINTS; ++point) {
+    const double position = (double) point / (double) (NUM_SWEEP_POINTS - 1);
+    set_controls(descriptor, options, controls, sample_rate, position);
+
+    for (unsigned long b = 0; b < points_blocks; ++b) {
+      const double start = now_ns();
+      for (unsigned long h = 0; h < handle_count; ++h) {
+        if (batched)
+          batch->run(handles[h], block_size);
+        else
+          descriptor->run(handles[h], block_size);
+      }
+      total += now_ns() - start;
+    }
+  }
+
+  *ns_per_sample = total / ((double) NUM_SWEEP_POINTS * (double) points_blocks *
+                            (double) block_size * (double) channels);
+  status = 0;
+
+done:
+  if (handles) {
+    for (unsigned long h = 0; h < handle_count; ++h) {
+      if (handles[h] == NULL)
+        continue;
+      if (batched) {
+        if (batch->deactivate)
+          batch->deactivate(handles[h]);
+        batch->cleanup(handles[h]);
+      } else {
+        if (descriptor->deactivate)
+          descriptor->deactivate(handles[h]);
+        descriptor->cleanup(handles[h]);
+      }
+    }
+  }
+  free(handles);
+  free(controls);
+  free(audio);
+  return status;
+}
+
+/* Compares options->channels instances of a plugin with a batch of that
+ * many channels, at one rate and every block size */
+static void bench_batch(const LLP_Batch_Descriptor *batch, const struct options *options)
+{
+  const unsigned long sample_rate = options->sample_rate ? options->sample_rate : TAIL_SAMPLE_RATE;
+
+  printf("%s (UID %lu), %lu Hz, %lu channels\n",
+         batch->Descriptor->Name, batch->Descriptor->UniqueID, sample_rate, options->channels);
+  printf("  %6s %10s %10s %8s\n", "block", "instances", "batch", "speedup");
+
+  for (unsigned long block_size = 1; block_size <= MAX_BLOCK_SIZE; block_size *= 2) {
+    if (options->block_size && options->block_size != block_size)
+      continue;
+
+    double instances, batched;
+    if (run_channels(batch, options, sample_rate, block_size, 0, &instances) < 0 ||
+        run_channels(batch, options, sample_rate, block_size, 1, &batched) < 0) {
+      printf("  %6lu   failed to instantiate\n", block_size);
+      continue;
+    }
+
+    printf("  %6lu %10.2f %10.2f %7.2fx\n", block_size, instances, batched, instances / batched);
+    fflush(stdout);
+  }
+
+  printf("\n");
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-c] [-p plugin] [-r rate] [-b block] [-s seconds]\n"
+          "          [-t seconds] [-B channels] [-P port=value]... [library]\n"
+          "\n"
+          "  -c          print a checksum of each plugin's output instead of timing\n"
+          "  -p plugin   only benchmark the plugin with this name\n"
+          "  -r rate     only benchmark this sample rate\n"
+          "  -b block    only benchmark this block size (power of two, max %d)\n"
+          "  -s seconds  seconds of audio per configuration (default 1)\n"
+          "  -t seconds  time each second of a silent tail this long, after a\n"
+          "              second of noise, at one rate and block size (default\n"
+          "              %d Hz, %d samples)\n"
+          "  -B channels compare this many instances of each plugin that has a\n"
+          "              batch version with one batch of this many channels, in\n"
+          "              ns per sample per channel, at one rate (default %d Hz)\n"
+          "  -P port=value\n"
+          "              hold the control port with this name at a fixed value\n"
+          "              instead of sweeping it (up to %d ports)\n"
+          "\n"
+          "The library defaults to %s.\n",
+          argv0, MAX_BLOCK_SIZE, TAIL_SAMPLE_RATE, TAIL_BLOCK_SIZE, TAIL_SAMPLE_RATE, MAX_PINS,
+          DEFAULT_LIBRARY);
+}
+
+int main(int argc, char **argv)
+{
+  struct options options = {
+    .library = DEFAULT_LIBRARY,
+    .seconds = 1.,
+  };
+
+  int opt;
+  char *equals;
+  while ((opt = getopt(argc, argv, "cp:r:b:s:t:B:P:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      options.check = 1;
+      break;
+    case 'p':
+      options.plugin = optarg;
+      break;
+    case 'r':
+      options.sample_rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      options.block_size = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      options.seconds = strtod(optarg, NULL);
+      break;
+    case 't':
+      options.tail = strtoul(optarg, NULL, 10);
+      break;
+    case 'B':
+      options.channels = strtoul(optarg, NULL, 10);
+      break;
+    case 'P':
+      equals = strrchr(optarg, '=');
+      if (equals == NULL || options.num_pins == MAX_PINS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      *equals = '\0';
+      options.pins[options.num_pins].name = optarg;
+      options.pins[options.num_pins].value = strtof(equals + 1, NULL);
+      ++options.num_pins;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc)
+    options.library = argv[optind];
+
+  if (options.seconds <= 0.) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  void *library = dlopen(options.library, RTLD_NOW | RTLD_LOCAL);
+  if (library == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    return EXIT_FAILURE;
+  }
+
+  LADSPA_Descriptor_Function ladspa_descriptor;
+  *(void **) &ladspa_descriptor = dlsym(library, "ladspa_descriptor");
+  if (ladspa_descriptor == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    dlclose(library);
+    return EXIT_FAILURE;
+  }
+
+  /* Only this library has batch versions of its plugins */
+  LLP_Batch_Descriptor_Function llp_batch_descriptor;
+  *(void **) &llp_batch_descriptor = dlsym(library, "llp_batch_descriptor");
+
+  int status = EXIT_SUCCESS;
+  const LADSPA_Descriptor *descriptor;
+  for (unsigned long i = 0; (descriptor = ladspa_descriptor(i)) != NULL; ++i) {
+    if (options.plugin && strcasecmp(options.plugin, descriptor->Name) != 0)
+      continue;
+    const LLP_Batch_Descriptor *batch = llp_batch_descriptor ? llp_batch_descriptor(i) : NULL;
+    if (options.check) {
+      if (check(descriptor, batch) < 0)
+        status = EXIT_FAILURE;
+    } else if (options.channels) {
+      if (batch)
+        bench_batch(batch, &options);
+    } else if (options.tail) {
+      if (run_tail(descriptor, &options) < 0)
+        status = EXIT_FAILURE;
+    } else {
+      bench_descriptor(descriptor, &options);
+    }
+  }
+
+  dlclose(library);
+  return status;
+}
@@ -0,0 +1,735 @@
+/*
+ * Standalone chain runner
+ *
+ * Loads the plugin library, builds a chain of plugins from the command
+ * line and streams raw PCM through it, from stdin to stdout. Each plugin
+ * runs on a thread of its own, pinned to a CPU, and hands its output to
+ * the next one through a lock-free single-producer/single-consumer ring
+ * of blocks, so a deep chain or a long render is spread across cores.
+ * Reading stdin and writing stdout get threads of their own too.
+ *
+ * Samples are native-endian 32-bit floats, interleaved. The input has a
+ * channel per audio input of the first plugin and the output a channel
+ * per audio output of the last one. Between plugins, when there are
+ * fewer outputs than the next plugin has inputs, they are repeated in
+ * order, and when there are more, those that land on the same input are
+ * averaged.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ladspa.h"
+
+#define DEFAULT_LIBRARY "build/libllp.so"
+#define DEFAULT_SAMPLE_RATE 48000
+#define DEFAULT_BLOCK_SIZE 256
+#define DEFAULT_RING_BLOCKS 8
+
+#define MAX_STAGES 32
+
+/* Polls of a ring before a waiting thread yields its CPU */
+#define SPIN_LIMIT 256
+
+#define CACHE_LINE_SIZE 64
+
+/* A block of planar audio: channel c starts at data[c * block size]. A
+ * block without frames ends the stream. */
+struct block {
+  unsigned long    frames;
+  LADSPA_Data     *data;
+};
+
+/* Ring of blocks between one producer and one consumer. The producer owns
+ * the blocks from head up to tail + capacity and the consumer those from
+ * tail up to head; each publishes its counter with a release store once it
+ * is done with a block, and reads the other one's with an acquire load. */
+struct ring {
+  _Alignas(CACHE_LINE_SIZE) atomic_ulong head;
+  _Alignas(CACHE_LINE_SIZE) atomic_ulong tail;
+  _Alignas(CACHE_LINE_SIZE) unsigned long capacity;
+  unsigned long    channels;
+  struct block    *blocks;
+  LADSPA_Data     *data;
+};
+
+struct stage {
+  const LADSPA_Descriptor *descriptor;
+  LADSPA_Handle    handle;
+  LADSPA_Data     *controls;
+
+  /* Audio ports, in port order */
+  unsigned long   *inputs;
+  unsigned long    num_inputs;
+  unsigned long   *outputs;
+  unsigned long    num_outputs;
+
+  /* Inputs mixed down from a ring with more channels than there are
+   * inputs */
+  LADSPA_Data     *mixed;
+
+  struct ring     *in;
+  struct ring     *out;
+  unsigned long    block_size;
+  int              cpu;
+  double           busy_ns;
+  pthread_t        thread;
+};
+
+struct options {
+  const char      *library;
+  unsigned long    sample_rate;
+  unsigned long    block_size;
+  unsigned long    ring_blocks;
+  double           tail;
+  int              cpus[MAX_STAGES];
+  unsigned long    num_cpus;
+  int              verbose;
+};
+
+/* Reads stdin into the first ring, followed by the silent tail */
+struct reader {
+  struct ring     *out;
+  unsigned long    block_size;
+  unsigned long    tail_frames;
+  unsigned long    frames;
+  int              failed;
+  pthread_t        thread;
+};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void backoff(unsigned long *spins)
+{
+  if (++*spins >= SPIN_LIMIT) {
+    *spins = 0;
+    sched_yield();
+  }
+}
+
+static int ring_init(struct ring *ring, unsigned long capacity, unsigned long channels, unsigned long block_size)
+{
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->capacity = capacity;
+  ring->channels = channels;
+  ring->blocks = calloc(capacity, sizeof(*ring->blocks));
+  ring->data = calloc(capacity * channels * block_size, sizeof(*ring->data));
+  if (ring->blocks == NULL || ring->data == NULL)
+    return -1;
+
+  for (unsigned long b = 0; b < capacity; ++b)
+    ring->blocks[b].data = &ring->data[b * channels * block_size];
+  return 0;
+}
+
+static void ring_destroy(struct ring *ring)
+{
+  free(ring->data);
+  free(ring->blocks);
+}
+
+/* Waits for a free block to write */
+static struct block *ring_write(struct ring *ring)
+{
+  const unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned long spins = 0;
+  while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == ring->capacity)
+    backoff(&spins);
+  return &ring->blocks[head % ring->capacity];
+}
+
+/* Hands the block from ring_write() to the consumer */
+static void ring_commit(struct ring *ring)
+{
+  const unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Waits for a block to read */
+static struct block *ring_read(struct ring *ring)
+{
+  const unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned long spins = 0;
+  while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+    backoff(&spins);
+  return &ring->blocks[tail % ring->capacity];
+}
+
+/* Hands the block from ring_read() back to the producer */
+static void ring_release(struct ring *ring)
+{
+  const unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* The default a port's range hint asks for, or the middle of its range if
+ * it has none */
+static LADSPA_Data default_value(const LADSPA_PortRangeHint *hint, unsigned long sample_rate)
+{
+  const LADSPA_PortRangeHintDescriptor hd = hint->HintDescriptor;
+
+  switch (hd & LADSPA_HINT_DEFAULT_MASK) {
+  case LADSPA_HINT_DEFAULT_0:
+    return 0.f;
+  case LADSPA_HINT_DEFAULT_1:
+    return 1.f;
+  case LADSPA_HINT_DEFAULT_100:
+    return 100.f;
+  case LADSPA_HINT_DEFAULT_440:
+    return 440.f;
+  }
+
+  double lower = LADSPA_IS_HINT_BOUNDED_BELOW(hd) ? hint->LowerBound : 0.;
+  double upper = LADSPA_IS_HINT_BOUNDED_ABOVE(hd) ? hint->UpperBound : 1.;
+
+  if (LADSPA_IS_HINT_SAMPLE_RATE(hd)) {
+    lower *= (double) sample_rate;
+    upper *= (double) sample_rate;
+  }
+
+  double position;
+  switch (hd & LADSPA_HINT_DEFAULT_MASK) {
+  case LADSPA_HINT_DEFAULT_MINIMUM:
+    position = 0.;
+    break;
+  case LADSPA_HINT_DEFAULT_LOW:
+    position = .25;
+    break;
+  case LADSPA_HINT_DEFAULT_HIGH:
+    position = .75;
+    break;
+  case LADSPA_HINT_DEFAULT_MAXIMUM:
+    position = 1.;
+    break;
+  default:
+    position = .5;
+    break;
+  }
+
+  double value;
+  if (LADSPA_IS_HINT_LOGARITHMIC(hd) && lower > 0.)
+    value = exp(log(lower) + position * (log(upper) - log(lower)));
+  else
+    value = lower + position * (upper - lower);
+
+  if (LADSPA_IS_HINT_INTEGER(hd) || LADSPA_IS_HINT_TOGGLED(hd))
+    value = round(value);
+
+  return (LADSPA_Data) value;
+}
+
+/* Sets the control ports of a stage from "name:port=value,port=value",
+ * to their defaults first */
+static int set_controls(struct stage *stage, const char *assignments, unsigned long sample_rate)
+{
+  const LADSPA_Descriptor *descriptor = stage->descriptor;
+
+  for (unsigned long p = 0; p < descriptor->PortCount; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (LADSPA_IS_PORT_CONTROL(pd) && LADSPA_IS_PORT_INPUT(pd))
+      stage->controls[p] = default_value(&descriptor->PortRangeHints[p], sample_rate);
+  }
+
+  if (assignments == NULL)
+    return 0;
+
+  char *copy = strdup(assignments);
+  if (copy == NULL)
+    return -1;
+
+  int status = 0;
+  char *saveptr;
+  for (char *assignment = strtok_r(copy, ",", &saveptr);
+       assignment != NULL;
+       assignment = strtok_r(NULL, ",", &saveptr)) {
+    char *equals = strrchr(assignment, '=');
+    if (equals == NULL) {
+      fprintf(stderr, "%s: expected port=value, got \"%s\"\n", descriptor->Name, assignment);
+      status = -1;
+      break;
+    }
+    *equals = '\0';
+
+    unsigned long p = 0;
+    for (; p < descriptor->PortCount; ++p) {
+      const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+      if (LADSPA_IS_PORT_CONTROL(pd) && LADSPA_IS_PORT_INPUT(pd) &&
+          strcasecmp(assignment, descriptor->PortNames[p]) == 0)
+        break;
+    }
+    if (p == descriptor->PortCount) {
+      fprintf(stderr, "%s: no control input named \"%s\"\n", descriptor->Name, assignment);
+      status = -1;
+      break;
+    }
+    stage->controls[p] = strtof(equals + 1, NULL);
+  }
+
+  free(copy);
+  return status;
+}
+
+/* Instantiates the plugin a "name[:port=value,...]" spec names */
+static int stage_init(struct stage *stage,
+                      LADSPA_Descriptor_Function ladspa_descriptor,
+                      const char *spec,
+                      const struct options *options)
+{
+  const char *colon = strchr(spec, ':');
+  const size_t name_length = colon ? (size_t) (colon - spec) : strlen(spec);
+
+  const LADSPA_Descriptor *descriptor;
+  for (unsigned long i = 0; (descriptor = ladspa_descriptor(i)) != NULL; ++i)
+    if (strncasecmp(spec, descriptor->Name, name_length) == 0 && descriptor->Name[name_length] == '\0')
+      break;
+  if (descriptor == NULL) {
+    fprintf(stderr, "no plugin named \"%.*s\"\n", (int) name_length, spec);
+    return -1;
+  }
+
+  const unsigned long port_count = descriptor->PortCount;
+  stage->descriptor = descriptor;
+  stage->block_size = options->block_size;
+  stage->controls = calloc(port_count, sizeof(*stage->controls));
+  stage->inputs = calloc(port_count, sizeof(*stage->inputs));
+  stage->outputs = calloc(port_count, sizeof(*stage->outputs));
+  if (stage->controls == NULL || stage->inputs == NULL || stage->outputs == NULL)
+    return -1;
+
+  for (unsigned long p = 0; p < port_count; ++p) {
+    const LADSPA_PortDescriptor pd = descriptor->PortDescriptors[p];
+    if (!LADSPA_IS_PORT_AUDIO(pd))
+      continue;
+    if (LADSPA_IS_PORT_INPUT(pd))
+      stage->inputs[stage->num_inputs++] = p;
+    else
+      stage->outputs[stage->num_outputs++] = p;
+  }
+  if (stage->num_inputs == 0 || stage->num_outputs == 0) {
+    fprintf(stderr, "%s: needs both audio inputs and outputs\n", descriptor->Name);
+    return -1;
+  }
+
+  stage->mixed = calloc(stage->num_inputs * options->block_size, sizeof(*stage->mixed));
+  if (stage->mixed == NULL)
+    return -1;
+
+  if (set_controls(stage, colon ? colon + 1 : NULL, options->sample_rate) < 0)
+    return -1;
+
+  stage->handle = descriptor->instantiate(descriptor, options->sample_rate);
+  if (stage->handle == NULL) {
+    fprintf(stderr, "%s: failed to instantiate\n", descriptor->Name);
+    return -1;
+  }
+
+  for (unsigned long p = 0; p < port_count; ++p)
+    if (LADSPA_IS_PORT_CONTROL(descriptor->PortDescriptors[p]))
+      descriptor->connect_port(stage->handle, p, &stage->controls[p]);
+
+  if (descriptor->activate)
+    descriptor->activate(stage->handle);
+
+  return 0;
+}
+
+static void stage_destroy(struct stage *stage)
+{
+  if (stage->handle) {
+    if (stage->descriptor->deactivate)
+      stage->descriptor->deactivate(stage->handle);
+    stage->descriptor->cleanup(stage->handle);
+  }
+  free(stage->mixed);
+  free(stage->outputs);
+  free(stage->inputs);
+  free(stage->controls);
+}
+
+/* Connects the audio inputs of a stage to the channels of a block */
+static void connect_inputs(struct stage *stage, struct block *in)
+{
+  const LADSPA_Descriptor *descriptor = stage->descriptor;
+  const unsigned long block_size = stage->block_size;
+  const unsigned long channels = stage->in->channels;
+  const unsigned long num_inputs = stage->num_inputs;
+
+  if (channels <= num_inputs) {
+    for (unsigned long i = 0; i < num_inputs; ++i)
+      descriptor->connect_port(stage->handle, stage->inputs[i], &in->data[(i % channels) * block_size]);
+    return;
+  }
+
+  for (unsigned long i = 0; i < num_inputs; ++i) {
+    LADSPA_Data *const mixed = &stage->mixed[i * block_size];
+    const unsigned long sources = (channels - i + num_inputs - 1) / num_inputs;
+    const LADSPA_Data scale = 1.f / (LADSPA_Data) sources;
+
+    memset(mixed, 0, sizeof(*mixed) * in->frames);
+    for (unsigned long c = i; c < channels; c += num_inputs)
+      for (unsigned long k = 0; k < in->frames; ++k)
+        mixed[k] += in->data[c * block_size + k];
+    for (unsigned long k = 0; k < in->frames; ++k)
+      mixed[k] *= scale;
+
+    descriptor->connect_port(stage->handle, stage->inputs[i], mixed);
+  }
+}
+
+static void *stage_thread(void *arg)
+{
+  struct stage *const stage = arg;
+  const LADSPA_Descriptor *descriptor = stage->descriptor;
+
+  if (stage->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(stage->cpu, &set);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error)
+      fprintf(stderr, "%s: failed to pin to CPU %d: %s\n", descriptor->Name, stage->cpu, strerror(error));
+  }
+
+  for (;;) {
+    struct block *const in = ring_read(stage->in);
+    struct block *const out = ring_write(stage->out);
+    const unsigned long frames = in->frames;
+
+    out->frames = frames;
+    if (frames) {
+      connect_inputs(stage, in);
+      for (unsigned long o = 0; o < stage->num_outputs; ++o)
+        descriptor->connect_port(stage->handle, stage->outputs[o], &out->data[o * stage->block_size]);
+
+      const double start = now_ns();
+      descriptor->run(stage->handle, frames);
+      stage->busy_ns += now_ns() - start;
+    }
+
+    ring_commit(stage->out);
+    ring_release(stage->in);
+
+    if (frames == 0)
+      break;
+  }
+
+  return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+  struct reader *const reader = arg;
+  struct ring *const ring = reader->out;
+  const unsigned long channels = ring->channels;
+  const unsigned long block_size = reader->block_size;
+  LADSPA_Data *interleaved = malloc(sizeof(*interleaved) * channels * block_size);
+  unsigned long tail = reader->tail_frames;
+  int eof = 0;
+
+  if (interleaved == NULL) {
+    reader->failed = 1;
+    eof = 1;
+    tail = 0;
+  }
+
+  /* After the input, the tail fills up its last block and then takes
+   * whole ones, and an empty block ends the stream */
+  for (;;) {
+    struct block *const block = ring_write(ring);
+    unsigned long frames = 0;
+
+    if (!eof) {
+      frames = fread(interleaved, sizeof(*interleaved) * channels, block_size, stdin);
+      for (unsigned long k = 0; k < frames; ++k)
+        for (unsigned long c = 0; c < channels; ++c)
+          block->data[c * block_size + k] = interleaved[k * channels + c];
+
+      if (frames < block_size) {
+        eof = 1;
+        if (ferror(stdin)) {
+          fprintf(stderr, "failed to read input: %s\n", strerror(errno));
+          reader->failed = 1;
+          tail = 0;
+        }
+      }
+    }
+
+    if (eof) {
+      unsigned long count = block_size - frames;
+      if (count > tail)
+        count = tail;
+      for (unsigned long c = 0; c < channels; ++c)
+        memset(&block->data[c * block_size + frames], 0, sizeof(*block->data) * count);
+      frames += count;
+      tail -= count;
+    }
+
+    block->frames = frames;
+    reader->frames += frames;
+    ring_commit(ring);
+
+    if (frames == 0)
+      break;
+  }
+
+  free(interleaved);
+  return NULL;
+}
+
+/* Writes the blocks of the last ring to stdout until the stream ends.
+ * After a failed write the rest is drained, so the stages can finish. */
+static int write_output(struct ring *ring, unsigned long block_size)
+{
+  const unsigned long channels = ring->channels;
+  LADSPA_Data *interleaved = malloc(sizeof(*interleaved) * channels * block_size);
+  int status = interleaved ? 0 : -1;
+
+  for (;;) {
+    struct block *const block = ring_read(ring);
+    const unsigned long frames = block->frames;
+
+    if (frames && status == 0) {
+      for (unsigned long c = 0; c < channels; ++c)
+        for (unsigned long k = 0; k < frames; ++k)
+          interleaved[k * channels + c] = block->data[c * block_size + k];
+
+      if (fwrite(interleaved, sizeof(*interleaved) * channels, frames, stdout) != frames) {
+        fprintf(stderr, "failed to write output: %s\n", strerror(errno));
+        status = -1;
+      }
+    }
+
+    ring_release(ring);
+
+    if (frames == 0)
+      break;
+  }
+
+  if (fflush(stdout) != 0 && status == 0) {
+    fprintf(stderr, "failed to write output: %s\n", strerror(errno));
+    status = -1;
+  }
+
+  free(interleaved);
+  return status;
+}
+
+/* Parses a comma separated list of CPUs */
+static int parse_cpus(const char *list, struct options *options)
+{
+  options->num_cpus = 0;
+  while (*list) {
+    char *end;
+    const long cpu = strtol(list, &end, 10);
+    if (end == list || cpu < 0 || options->num_cpus == MAX_STAGES)
+      return -1;
+    options->cpus[options->num_cpus++] = (int) cpu;
+    list = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0')
+      return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-l library] [-r rate] [-b block] [-n blocks] [-t seconds]\n"
+          "          [-C cpu,...] [-v] plugin[:port=value,...]...\n"
+          "\n"
+          "Streams raw native-endian float samples, interleaved, from stdin\n"
+          "through the plugins in order to stdout, running each on a thread of\n"
+          "its own. Control ports that aren't set take their defaults.\n"
+          "\n"
+          "  -l library  plugin library (default %s)\n"
+          "  -r rate     sample rate (default %d)\n"
+          "  -b block    samples per run() (default %d)\n"
+          "  -n blocks   blocks in each ring between threads (default %d)\n"
+          "  -t seconds  append this much silence to the input, to let tails ring\n"
+          "              out\n"
+          "  -C cpu,...  pin the plugins to these CPUs in turn (default: plugin i\n"
+          "              on CPU i modulo the number of CPUs online)\n"
+          "  -v          print the throughput and the load of each plugin to\n"
+          "              stderr when done\n"
+          "\n"
+          "e.g. %s Granular \"Orbital delay:Orbital=1\" Orbit < in.f32 > out.f32\n",
+          argv0, DEFAULT_LIBRARY, DEFAULT_SAMPLE_RATE, DEFAULT_BLOCK_SIZE, DEFAULT_RING_BLOCKS, argv0);
+}
+
+int main(int argc, char **argv)
+{
+  struct options options = {
+    .library = DEFAULT_LIBRARY,
+    .sample_rate = DEFAULT_SAMPLE_RATE,
+    .block_size = DEFAULT_BLOCK_SIZE,
+    .ring_blocks = DEFAULT_RING_BLOCKS,
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:r:b:n:t:C:vh")) != -1) {
+    switch (opt) {
+    case 'l':
+      options.library = optarg;
+      break;
+    case 'r':
+      options.sample_rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      options.block_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      options.ring_blocks = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      options.tail = strtod(optarg, NULL);
+      break;
+    case 'C':
+      if (parse_cpus(optarg, &options) < 0 || options.num_cpus == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'v':
+      options.verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  const unsigned long num_stages = (unsigned long) (argc - optind);
+  if (num_stages == 0 || num_stages > MAX_STAGES || options.sample_rate == 0 ||
+      options.block_size == 0 || options.ring_blocks == 0 || options.tail < 0.) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  void *library = dlopen(options.library, RTLD_NOW | RTLD_LOCAL);
+  if (library == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    return EXIT_FAILURE;
+  }
+
+  LADSPA_Descriptor_Function ladspa_descriptor;
+  *(void **) &ladspa_descriptor = dlsym(library, "ladspa_descriptor");
+  if (ladspa_descriptor == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    dlclose(library);
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_FAILURE;
+  struct stage stages[MAX_STAGES] = {0};
+  struct ring rings[MAX_STAGES + 1] = {0};
+  unsigned long num_rings = 0;
+  unsigned long started = 0;
+
+  const long online = sysconf(_SC_NPROCESSORS_ONLN);
+  for (unsigned long s = 0; s < num_stages; ++s) {
+    if (stage_init(&stages[s], ladspa_descriptor, argv[optind + s], &options) < 0)
+      goto done;
+    if (options.num_cpus)
+      stages[s].cpu = options.cpus[s % options.num_cpus];
+    else
+      stages[s].cpu = online > 0 ? (int) (s % (unsigned long) online) : -1;
+  }
+
+  /* Ring s feeds stage s, and the last one stdout */
+  for (; num_rings <= num_stages; ++num_rings) {
+    const unsigned long channels = num_rings == 0 ? stages[0].num_inputs : stages[num_rings - 1].num_outputs;
+    if (ring_init(&rings[num_rings], options.ring_blocks, channels, options.block_size) < 0) {
+      ++num_rings;
+      fprintf(stderr, "out of memory\n");
+      goto done;
+    }
+  }
+  for (unsigned long s = 0; s < num_stages; ++s) {
+    stages[s].in = &rings[s];
+    stages[s].out = &rings[s + 1];
+  }
+
+  struct reader reader = {
+    .out = &rings[0],
+    .block_size = options.block_size,
+    .tail_frames = (unsigned long) (options.tail * (double) options.sample_rate),
+  };
+
+  const double start = now_ns();
+
+  for (; started < num_stages; ++started) {
+    const int error = pthread_create(&stages[started].thread, NULL, stage_thread, &stages[started]);
+    if (error) {
+      fprintf(stderr, "failed to start a thread: %s\n", strerror(error));
+      break;
+    }
+  }
+
+  /* Without every stage running, an empty stream still shuts down the ones
+   * that are */
+  int error = 0;
+  if (started < num_stages) {
+    ring_write(&rings[0])->frames = 0;
+    ring_commit(&rings[0]);
+  } else {
+    error = pthread_create(&reader.thread, NULL, reader_thread, &reader);
+    if (error) {
+      fprintf(stderr, "failed to start a thread: %s\n", strerror(error));
+      ring_write(&rings[0])->frames = 0;
+      ring_commit(&rings[0]);
+    }
+  }
+
+  int written = 0;
+  if (started == num_stages)
+    written = write_output(&rings[num_stages], options.block_size);
+
+  if (started == num_stages && !error)
+    pthread_join(reader.thread, NULL);
+  for (unsigned long s = 0; s < started; ++s)
+    pthread_join(stages[s].thread, NULL);
+
+  const double elapsed = now_ns() - start;
+
+  if (started < num_stages || error || written < 0 || reader.failed)
+    goto done;
+  status = EXIT_SUCCESS;
+
+  if (options.verbose) {
+    const double seconds = (double) reader.frames / (double) options.sample_rate;
+    fprintf(stderr, "%lu frames (%.2f s) in %.2f s, %.2fx real time\n",
+            reader.frames, seconds, elapsed / 1e9, seconds / (elapsed / 1e9));
+    fprintf(stderr, "  %-16s %4s %10s %8s\n", "plugin", "cpu", "ns/sample", "load");
+    for (unsigned long s = 0; s < num_stages; ++s)
+      fprintf(stderr, "  %-16s %4d %10.2f %7.1f%%\n",
+              stages[s].descriptor->Name, stages[s].cpu,
+              reader.frames ? stages[s].busy_ns / (double) reader.frames : 0.,
+              100. * stages[s].busy_ns / elapsed);
+  }
+
+done:
+  for (unsigned long r = 0; r < num_rings; ++r)
+    ring_destroy(&rings[r]);
+  for (unsigned long s = 0; s < num_stages; ++s)
+    stage_destroy(&stages[s]);
+  dlclose(library);
+  return status;
+}